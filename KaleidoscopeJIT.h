@@ -0,0 +1,319 @@
+//===----- KaleidoscopeJIT.h - A simple JIT for Kaleidoscope ----*- C++ -*-===//
+//
+// The JIT used by toy-7.cpp. It starts from the one shipped in
+// llvm/examples/Kaleidoscope/include and adds the hooks toy-7 needs, such as
+// an object cache and background compilation on a thread pool.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
+#define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Mangler.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace llvm {
+namespace orc {
+
+class KaleidoscopeJIT {
+public:
+  /// A step run on a module right before codegen, given the TargetMachine that
+  /// is about to compile it.
+  typedef std::function<void(Module &, TargetMachine &)> PrepareFunction;
+
+private:
+  typedef object::OwningBinary<object::ObjectFile> OwningObject;
+
+  /// CompileJob - A module waiting for, or finished with, a compile thread.
+  /// The job owns the module's context, so nothing else may touch either
+  /// until Done is ready.
+  struct CompileJob {
+    std::unique_ptr<LLVMContext> Context;
+    std::unique_ptr<Module> M;
+    PrepareFunction Prepare;
+    std::unique_ptr<OwningObject> Obj;
+    std::shared_future<void> Done;
+  };
+
+  CodeGenOpt::Level OptLevel;
+  TargetOptions Options;
+  std::unique_ptr<TargetMachine> TM;
+  const DataLayout DL;
+  ObjectLinkingLayer<> ObjectLayer;
+  ObjectCache *ObjCache = nullptr;
+  std::mutex CacheMutex;
+
+  // Addresses the resolver has already looked up, so that linking a module
+  // does not search every object set added so far.  Nothing links against a
+  // transient module, so removing one leaves this alone; removing any other
+  // module flushes it, and adding one drops the symbols it redefines.
+  StringMap<std::pair<JITTargetAddress, JITSymbolFlags>> ResolvedSymbols;
+  std::vector<ObjectLinkingLayer<>::ObjSetHandleT> TransientSets;
+
+  // A TargetMachine is not thread-safe, so each compile thread borrows its
+  // own from this pool.
+  std::vector<std::unique_ptr<TargetMachine>> IdleTMs;
+  std::mutex TMMutex;
+
+  // Jobs in submission order; linked by the next findSymbol.
+  std::vector<std::unique_ptr<CompileJob>> PendingJobs;
+
+  // Declared last so it is destroyed first, waiting for running jobs.
+  std::unique_ptr<ThreadPool> CompileThreads;
+
+  /// createTargetMachine - A TargetMachine for the host CPU, so generated code
+  /// may use every vector extension it has (AVX and so on), not just the
+  /// baseline of its architecture.
+  TargetMachine *createTargetMachine() {
+    SmallVector<std::string, 16> Features;
+    StringMap<bool> HostFeatures;
+    if (sys::getHostCPUFeatures(HostFeatures))
+      for (auto &F : HostFeatures)
+        Features.push_back((F.second ? "+" : "-") + F.first().str());
+    return EngineBuilder()
+        .setOptLevel(OptLevel)
+        .setTargetOptions(Options)
+        .setMCPU(sys::getHostCPUName())
+        .setMAttrs(Features)
+        .selectTarget();
+  }
+
+  /// createResolver - Look symbols up in the JIT itself first (everything
+  /// added so far is one "logical dylib"), then in the host process.
+  std::unique_ptr<JITSymbolResolver> createResolver() {
+    return createLambdaResolver(
+        [&](const std::string &Name) {
+          auto I = ResolvedSymbols.find(Name);
+          if (I != ResolvedSymbols.end())
+            return JITSymbol(I->second.first, I->second.second);
+          if (auto Sym = ObjectLayer.findSymbol(Name, false)) {
+            JITSymbolFlags Flags = Sym.getFlags();
+            JITTargetAddress Addr = Sym.getAddress();
+            ResolvedSymbols[Name] = std::make_pair(Addr, Flags);
+            return JITSymbol(Addr, Flags);
+          }
+          return JITSymbol(nullptr);
+        },
+        [&](const std::string &Name) {
+          if (auto SymAddr =
+                  RTDyldMemoryManager::getSymbolAddressInProcess(Name)) {
+            ResolvedSymbols[Name] =
+                std::make_pair(SymAddr, JITSymbolFlags::Exported);
+            return JITSymbol(SymAddr, JITSymbolFlags::Exported);
+          }
+          return JITSymbol(nullptr);
+        });
+  }
+
+  std::string mangle(const std::string &Name) {
+    std::string MangledName;
+    raw_string_ostream MangledNameStream(MangledName);
+    Mangler::getNameWithPrefix(MangledNameStream, Name, DL);
+    return MangledNameStream.str();
+  }
+
+  ObjectLinkingLayer<>::ObjSetHandleT
+  addObject(std::unique_ptr<OwningObject> Obj) {
+    if (object::ObjectFile *Bin = Obj->getBinary())
+      forgetDefinedSymbols(*Bin);
+    std::vector<std::unique_ptr<OwningObject>> Objs;
+    Objs.push_back(std::move(Obj));
+    return ObjectLayer.addObjectSet(std::move(Objs),
+                                    make_unique<SectionMemoryManager>(),
+                                    createResolver());
+  }
+
+  /// forgetDefinedSymbols - Drop the cached addresses of the symbols Bin
+  /// defines, so that modules linked from now on use its definitions rather
+  /// than the ones they replace.
+  void forgetDefinedSymbols(object::ObjectFile &Bin) {
+    for (const object::SymbolRef &Sym : Bin.symbols()) {
+      uint32_t Flags = Sym.getFlags();
+      if (!(Flags & object::SymbolRef::SF_Global) ||
+          (Flags & object::SymbolRef::SF_Undefined))
+        continue;
+      Expected<StringRef> Name = Sym.getName();
+      if (Name)
+        ResolvedSymbols.erase(*Name);
+      else
+        consumeError(Name.takeError());
+    }
+  }
+
+  /// compileModule - Produce M's object with CompileTM, asking the object
+  /// cache first if there is one and UseCache is set.  May run on any thread.
+  std::unique_ptr<OwningObject> compileModule(Module &M,
+                                              TargetMachine &CompileTM,
+                                              bool UseCache = true) {
+    if (ObjCache && UseCache) {
+      std::lock_guard<std::mutex> Lock(CacheMutex);
+      if (std::unique_ptr<MemoryBuffer> Buf = ObjCache->getObject(&M)) {
+        auto Obj = object::ObjectFile::createObjectFile(Buf->getMemBufferRef());
+        if (Obj)
+          return make_unique<OwningObject>(std::move(*Obj), std::move(Buf));
+        consumeError(Obj.takeError());
+      }
+    }
+
+    auto Obj = make_unique<OwningObject>(SimpleCompiler(CompileTM)(M));
+    if (ObjCache && UseCache && Obj->getBinary()) {
+      std::lock_guard<std::mutex> Lock(CacheMutex);
+      ObjCache->notifyObjectCompiled(&M, Obj->getBinary()->getMemoryBufferRef());
+    }
+    return Obj;
+  }
+
+  std::unique_ptr<TargetMachine> takeTargetMachine() {
+    std::lock_guard<std::mutex> Lock(TMMutex);
+    if (IdleTMs.empty())
+      return std::unique_ptr<TargetMachine>(createTargetMachine());
+    std::unique_ptr<TargetMachine> Result = std::move(IdleTMs.back());
+    IdleTMs.pop_back();
+    return Result;
+  }
+
+  void returnTargetMachine(std::unique_ptr<TargetMachine> T) {
+    std::lock_guard<std::mutex> Lock(TMMutex);
+    IdleTMs.push_back(std::move(T));
+  }
+
+  void runJob(CompileJob &J) {
+    std::unique_ptr<TargetMachine> CompileTM = takeTargetMachine();
+    if (J.Prepare)
+      J.Prepare(*J.M, *CompileTM);
+    J.Obj = compileModule(*J.M, *CompileTM);
+    returnTargetMachine(std::move(CompileTM));
+    // The module has to go before the context that owns its types.
+    J.M.reset();
+    J.Context.reset();
+  }
+
+  /// linkPendingJobs - Wait for every background compile and add the
+  /// resulting objects, in the order their modules were submitted.
+  void linkPendingJobs() {
+    for (auto &J : PendingJobs) {
+      J->Done.wait();
+      if (J->Obj->getBinary())
+        addObject(std::move(J->Obj));
+    }
+    PendingJobs.clear();
+  }
+
+public:
+  typedef ObjectLinkingLayer<>::ObjSetHandleT ModuleHandle;
+
+  explicit KaleidoscopeJIT(CodeGenOpt::Level OptLevel = CodeGenOpt::Default,
+                           const TargetOptions &Options = TargetOptions())
+      : OptLevel(OptLevel), Options(Options), TM(createTargetMachine()),
+        DL(TM->createDataLayout()) {
+    llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+  }
+
+  TargetMachine &getTargetMachine() { return *TM; }
+
+  /// setObjectCache - Ask Cache for a module's object before compiling it,
+  /// and hand it every object that does get compiled.  Pass nullptr to turn
+  /// caching off.
+  void setObjectCache(ObjectCache *Cache) { ObjCache = Cache; }
+
+  /// setCompileThreads - Run addModuleAsync jobs on N threads.  Zero makes
+  /// addModuleAsync compile on the calling thread.
+  void setCompileThreads(unsigned N) {
+    linkPendingJobs();
+    CompileThreads.reset(N ? new ThreadPool(N) : nullptr);
+  }
+
+  /// addModule - Compile M now and add it.  If Context is given it is M's
+  /// context, and the JIT frees it once M has been compiled.
+  ModuleHandle addModule(std::unique_ptr<Module> M,
+                         std::unique_ptr<LLVMContext> Context = nullptr) {
+    std::unique_ptr<OwningObject> Obj = compileModule(*M, *TM);
+    M.reset();
+    Context.reset();
+    return addObject(std::move(Obj));
+  }
+
+  /// addModuleAsync - Queue M, together with the context that owns it, for
+  /// a compile thread.  Prepare (e.g. an optimization pipeline) runs on that
+  /// thread just before codegen.  The object is linked in by the next
+  /// findSymbol, so callers only wait when they actually need a symbol.
+  /// Modules added this way are never removed.
+  void addModuleAsync(std::unique_ptr<Module> M,
+                      std::unique_ptr<LLVMContext> Context,
+                      PrepareFunction Prepare = nullptr) {
+    auto J = make_unique<CompileJob>();
+    J->Context = std::move(Context);
+    J->M = std::move(M);
+    J->Prepare = std::move(Prepare);
+    CompileJob *Job = J.get();
+    if (CompileThreads) {
+      J->Done = CompileThreads->async([this, Job]() { runJob(*Job); });
+    } else {
+      std::promise<void> Ready;
+      runJob(*Job);
+      Ready.set_value();
+      J->Done = Ready.get_future().share();
+    }
+    PendingJobs.push_back(std::move(J));
+  }
+
+  /// addTransientModule - Compile M, which stays with the caller, and add the
+  /// object.  This is for code that runs and is then removed again, such as a
+  /// REPL expression: it bypasses the object cache, and nothing else may be
+  /// linked against its symbols.
+  ModuleHandle addTransientModule(Module &M) {
+    ModuleHandle H = addObject(compileModule(M, *TM, /*UseCache=*/false));
+    TransientSets.push_back(H);
+    return H;
+  }
+
+  JITSymbol findSymbol(const std::string Name) {
+    linkPendingJobs();
+    return ObjectLayer.findSymbol(mangle(Name), true);
+  }
+
+  /// findSymbolIn - Look Name up in the module H only.
+  JITSymbol findSymbolIn(ModuleHandle H, const std::string Name) {
+    linkPendingJobs();
+    return ObjectLayer.findSymbolIn(H, mangle(Name), true);
+  }
+
+  void removeModule(ModuleHandle H) {
+    auto I = std::find(TransientSets.begin(), TransientSets.end(), H);
+    if (I != TransientSets.end())
+      TransientSets.erase(I);
+    else
+      ResolvedSymbols.clear();
+    ObjectLayer.removeObjectSet(H);
+  }
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
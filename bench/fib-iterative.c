@@ -0,0 +1,28 @@
+/* Iterative Fibonacci, as in fib-iterative.kal.  Kaleidoscope tests a loop's
+   end condition after its body, hence the do-while loops. */
+#include <stdio.h>
+
+double fibi(double x) {
+  double a = 1, b = 1, c = 0;
+  long i = 3;
+  do {
+    c = a + b;
+    a = b;
+    b = c;
+  } while (i++ < x);
+  return b;
+}
+
+double run(double n) {
+  double s = 0;
+  long k = 0;
+  do
+    s = s + fibi(90);
+  while (k++ < n);
+  return s;
+}
+
+int main(void) {
+  printf("%f\n", run(1000000));
+  return 0;
+}
@@ -0,0 +1,9 @@
+/* Recursive Fibonacci, as in fib-recursive.kal. */
+#include <stdio.h>
+
+double fib(double x) { return x < 3 ? 1 : fib(x - 1) + fib(x - 2); }
+
+int main(void) {
+  printf("%f\n", fib(35));
+  return 0;
+}
@@ -0,0 +1,62 @@
+/* The Mandelbrot set of mandelbrot.kal. */
+#include <stdio.h>
+
+double putchard(double x) {
+  fputc((char)x, stderr);
+  return 0;
+}
+
+double printdensity(double d) {
+  if (d > 8)
+    return putchard(32);
+  if (d > 4)
+    return putchard(46);
+  if (d > 2)
+    return putchard(43);
+  return putchard(42);
+}
+
+double mandelconverger(double real, double imag, double iters, double creal,
+                       double cimag) {
+  if (iters > 255 || real * real + imag * imag > 4)
+    return iters;
+  return mandelconverger(real * real - imag * imag + creal,
+                         2 * real * imag + cimag, iters + 1, creal, cimag);
+}
+
+double mandelconverge(double real, double imag) {
+  return mandelconverger(real, imag, 0, real, imag);
+}
+
+double mandelhelp(double xmin, double xmax, double xstep, double ymin,
+                  double ymax, double ystep) {
+  double y = ymin, x;
+  int more;
+  do {
+    x = xmin;
+    do {
+      printdensity(mandelconverge(x, y));
+      more = x < xmax;
+      x += xstep;
+    } while (more);
+    putchard(10);
+    more = y < ymax;
+    y += ystep;
+  } while (more);
+  return 0;
+}
+
+double mandel(double realstart, double imagstart, double realmag,
+              double imagmag) {
+  return mandelhelp(realstart, realstart + realmag * 78, realmag, imagstart,
+                    imagstart + imagmag * 40, imagmag);
+}
+
+int main(void) {
+  long i = 0;
+  do
+    mandel(-2.3, -1.3, 0.05, 0.07);
+  while (i++ < 100);
+  printf("%f\n", 0.0);
+  return 0;
+}
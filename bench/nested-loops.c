@@ -0,0 +1,19 @@
+/* Nested loops over a grid, as in nested-loops.kal. */
+#include <stdio.h>
+
+double grid(double n) {
+  double s = 0;
+  long i = 0, j;
+  do {
+    j = 0;
+    do
+      s = s + i * j - j;
+    while (j++ < n);
+  } while (i++ < n);
+  return s;
+}
+
+int main(void) {
+  printf("%f\n", grid(5000));
+  return 0;
+}
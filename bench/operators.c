@@ -0,0 +1,20 @@
+/* The computation of operators.kal, with C's built-in operators. */
+#include <stdio.h>
+
+double clamp(double x, double lo, double hi) {
+  return x < lo ? lo : x > hi ? hi : x;
+}
+
+double run(double n) {
+  double s = 0;
+  long i = 0;
+  do
+    s = s + ((i > 10 && i < n - 10) || i < 5 ? clamp(-i, -1000, 1000) : 1);
+  while (i++ < n);
+  return s;
+}
+
+int main(void) {
+  printf("%f\n", run(30000000));
+  return 0;
+}
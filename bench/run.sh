@@ -0,0 +1,114 @@
+#!/bin/sh
+# Run the benchmark corpus through toy-7 at each optimization setting, and the
+# C version of each program through a C compiler at the same levels.  For
+# every run, print the compile time, the run time and the peak RSS, and check
+# that the result matches the C version's.
+#
+# usage: bench/run.sh [path/to/toy-7.app]
+#
+# CC picks the C compiler (clang by default).  LEVELS lists the settings to
+# try: 'default' is the tutorial's function passes, a number is that -O level.
+# TOYFLAGS are passed to every toy-7 run, e.g. TOYFLAGS=-whole-program.
+#
+# Every compiler and program run is timed from outside by timeit.c, built
+# with CC first, which also gives its peak RSS.  toy-7 runs each program with
+# -batch, so compilation is over before the first top-level expression runs;
+# it reports the time it spent compiling through -time-report-json, and the
+# rest of its run is counted as run time.
+
+cd "$(dirname "$0")" || exit 1
+TOY=${1:-../toy-7.app}
+CC=${CC:-clang}
+LEVELS=${LEVELS:-"default 0 1 2 3"}
+PROGRAMS="fib-recursive fib-iterative mandelbrot nested-loops operators
+          functions-10k"
+
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+if ! $CC -O2 -o "$WORK/timeit" timeit.c; then
+  echo "$0: can't build timeit.c with $CC" >&2
+  exit 1
+fi
+
+# functions-10k: a chain of 10000 small functions, each calling the previous
+# one, generated in both languages.  It is mostly compile time.
+awk 'BEGIN {
+  print "def f0(x) x + 1;"
+  for (i = 1; i < 10000; i++)
+    printf "def f%d(x) if x < %d then f%d(x + 2) + 0.5 else f%d(x * 0.5);\n",
+           i, i % 100, i - 1, i - 1
+  print "f9999(3);"
+}' > "$WORK/functions-10k.kal"
+awk 'BEGIN {
+  print "#include <stdio.h>"
+  print "double f0(double x) { return x + 1; }"
+  for (i = 1; i < 10000; i++)
+    printf "double f%d(double x) { return x < %d ? f%d(x + 2) + 0.5 : f%d(x * 0.5); }\n",
+           i, i % 100, i - 1, i - 1
+  print "int main(void) { printf(\"%f\\n\", f9999(3)); return 0; }"
+}' > "$WORK/functions-10k.c"
+
+source_of() {
+  if [ -f "$1.$2" ]; then echo "$1.$2"; else echo "$WORK/$1.$2"; fi
+}
+
+# timed COMMAND... - Run COMMAND, leaving its wall ms and peak RSS KB in MS
+# and RSS.
+timed() {
+  "$WORK/timeit" "$WORK/timing" "$@"
+  STATUS=$?
+  read -r MS RSS < "$WORK/timing"
+  return $STATUS
+}
+
+# json_field FILE KEY - A number from the -time-report-json output: a phase's
+# seconds, or a top-level count.
+json_field() {
+  awk -v k="\"$2\":" '$1 == k { v = ($2 == "{\"seconds\":") ? $3 : $2
+                                gsub(/[,}]/, "", v); print v }' "$1"
+}
+
+row() { printf "%-14s %-10s %12s %10s %12s  %s\n" "$@"; }
+
+row program config "compile ms" "run ms" "peak RSS KB" result
+for P in $PROGRAMS; do
+  # The C version's result is the reference for toy-7's.
+  CSRC=$(source_of "$P" c)
+  EXPECTED=
+  for L in $LEVELS; do
+    [ "$L" = default ] && continue
+    # shellcheck disable=SC2086
+    if ! timed $CC -O"$L" -o "$WORK/$P" "$CSRC"; then
+      row "$P" "cc -O$L" - - - "does not compile"
+      continue
+    fi
+    COMPILE=$MS
+    timed "$WORK/$P" > "$WORK/out" 2>/dev/null
+    RUN=$MS
+    EXPECTED=$(tail -n 1 "$WORK/out")
+    row "$P" "cc -O$L" "$COMPILE" "$RUN" "$RSS" "$EXPECTED"
+  done
+
+  for L in $LEVELS; do
+    OPT=
+    [ "$L" != default ] && OPT=-O$L
+    CONFIG=$(echo "toy $OPT" | sed 's/ *$//')
+    rm -f "$WORK/report.json"
+    # shellcheck disable=SC2086
+    timed "$TOY" -batch $OPT $TOYFLAGS -time-report-json="$WORK/report.json" \
+      "$(source_of "$P" kal)" > /dev/null 2> "$WORK/out"
+    if [ ! -s "$WORK/report.json" ]; then
+      row "$P" "$CONFIG" - - - "failed"
+      continue
+    fi
+    COMPILE=$(for Phase in parse codegen optimize jit; do
+                json_field "$WORK/report.json" $Phase
+              done | awk '{ s += $1 } END { printf "%.1f", s * 1000 }')
+    RUN=$(awk -v t="$MS" -v c="$COMPILE" 'BEGIN { printf "%.1f", t - c }')
+    RESULT=$(grep "^Evaluated to" "$WORK/out" | tail -n 1 | cut -d' ' -f3)
+    [ -n "$EXPECTED" ] && [ "$RESULT" != "$EXPECTED" ] &&
+      RESULT="$RESULT (expected $EXPECTED)"
+    row "$P" "$CONFIG" "$COMPILE" "$RUN" "$RSS" "$RESULT"
+  done
+done
@@ -0,0 +1,63 @@
+/* Run a command and write its wall time in milliseconds and its peak RSS in
+   kilobytes, as "ms kb", to a file.  run.sh measures the C programs and
+   toy-7 with it alike; it only needs POSIX.
+
+   usage: timeit RESULT-FILE COMMAND [ARG...]
+
+   Exits with the command's status, or 127 if it could not be run. */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_ms(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s result-file command [arg...]\n", argv[0]);
+    return 2;
+  }
+
+  double start = now_ms();
+  pid_t child = fork();
+  if (child < 0) {
+    perror("fork");
+    return 127;
+  }
+  if (child == 0) {
+    execvp(argv[2], argv + 2);
+    perror(argv[2]);
+    _exit(127);
+  }
+  int status;
+  if (waitpid(child, &status, 0) < 0) {
+    perror("waitpid");
+    return 127;
+  }
+  double elapsed = now_ms() - start;
+
+  struct rusage usage;
+  long rss = -1;
+  if (getrusage(RUSAGE_CHILDREN, &usage) == 0)
+#ifdef __APPLE__
+    rss = usage.ru_maxrss / 1024; /* In bytes there. */
+#else
+    rss = usage.ru_maxrss;
+#endif
+
+  FILE *out = fopen(argv[1], "w");
+  if (!out) {
+    perror(argv[1]);
+    return 127;
+  }
+  fprintf(out, "%.1f %ld\n", elapsed, rss);
+  fclose(out);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
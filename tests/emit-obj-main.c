@@ -0,0 +1,13 @@
+/* Calls the definitions of emit-obj.kal, compiled by -emit-obj into k.o and
+   declared in k.h, as its top-level expressions do. */
+#include <stdio.h>
+
+#include "k.h"
+
+int main(void) {
+  printf("Evaluated to %f\n", fib(20));
+  printf("Evaluated to %f\n", (double)sumto(100));
+  printf("Evaluated to %f\n", wave(0));
+  printf("Evaluated to %f\n", poly(2));
+  return 0;
+}
@@ -0,0 +1,62 @@
+#!/bin/sh
+# Run each tests/*.kal once for every "# RUN:" line in it, and check that the
+# values the run evaluates to and the errors it reports match NAME.expected.
+# Every run of a test must give the same output.
+#
+# A RUN line is a shell command, in which
+#   %toy  is the toy-7 under test,
+#   %s    is the test file,
+#   %S    is the tests directory,
+#   %t    is an empty directory of the run's own, for files it writes, and
+#   %cc   is the C compiler, $CC or cc.
+# Input is empty unless the command redirects it.  A run whose command exits
+# with a non-zero status fails too.
+#
+# usage: tests/run.sh [path/to/toy-7.app]
+#
+# Exits with 1 if any run fails; the diff or status is printed.
+
+TOY=${1:-$(dirname "$0")/../toy-7.app}
+case $TOY in
+/*) ;;
+*) TOY=$PWD/$TOY ;;
+esac
+cd "$(dirname "$0")" || exit 1
+DIR=$PWD
+
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+# results FILE - What a run printed that a test checks: evaluated values,
+# without the tier -tiered adds, and errors.
+results() {
+  grep -o 'Evaluated to [^ ]*\|Error: .*' "$1"
+}
+
+FAILED=0
+N=0
+for T in *.kal; do
+  NAME=${T%.kal}
+  sed -n 's/^# RUN: *//p' "$T" > "$WORK/runs"
+  while read -r RUN; do
+    N=$((N + 1))
+    mkdir "$WORK/$N"
+    CMD=$(printf '%s\n' "$RUN" | sed -e "s|%toy|$TOY|g" -e "s|%cc|${CC:-cc}|g" \
+      -e "s|%S|$DIR|g" -e "s|%s|$T|g" -e "s|%t|$WORK/$N|g")
+    sh -c "$CMD" < /dev/null > "$WORK/out" 2>&1
+    STATUS=$?
+    results "$WORK/out" > "$WORK/actual"
+    if [ $STATUS -ne 0 ]; then
+      echo "FAIL $NAME: $RUN"
+      echo "exit status $STATUS"
+      FAILED=1
+    elif diff -u "$NAME.expected" "$WORK/actual" > "$WORK/diff"; then
+      echo "PASS $NAME: $RUN"
+    else
+      echo "FAIL $NAME: $RUN"
+      cat "$WORK/diff"
+      FAILED=1
+    fi
+  done < "$WORK/runs"
+done
+exit $FAILED
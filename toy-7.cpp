@@ -1,32 +1,73 @@
-#include "../include/KaleidoscopeJIT.h"
+#include "KaleidoscopeJIT.h"
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/ProfileSummary.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/AlwaysInliner.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
+#ifndef LLVM_ON_WIN32
+#include <sys/resource.h>
+#endif
 
 using namespace llvm;
 using namespace llvm::orc;
@@ -54,6 +95,7 @@ enum Token {
   tok_else = -8,
   tok_for = -9,
   tok_in = -10,
+  tok_parfor = -14,
 
   // operators
   tok_binary = -11,
@@ -63,61 +105,544 @@ enum Token {
   tok_var = -13
 };
 
-static std::string IdentifierStr; // Filled in if tok_identifier
-static double NumVal;             // Filled in if tok_number
+//===----------------------------------------------------------------------===//
+// Command line options
+//===----------------------------------------------------------------------===//
+
+static cl::opt<std::string> InputFilename(cl::Positional,
+                                          cl::desc("<input file>"),
+                                          cl::init("-"));
+
+enum BenchKind {
+  BenchNone,
+  BenchLex,
+  BenchParse,
+  BenchRepl,
+  BenchArrays,
+  BenchTailCalls,
+  BenchOperators,
+  BenchParfor,
+  BenchFastMath
+};
+
+static cl::opt<BenchKind> Bench(
+    "bench", cl::desc("Run an internal benchmark instead of the REPL"),
+    cl::init(BenchNone),
+    cl::values(clEnumValN(BenchLex, "lex",
+                          "Lexer throughput in MB/s over the input"),
+               clEnumValN(BenchParse, "parse",
+                          "Parser throughput and AST allocations over the "
+                          "input"),
+               clEnumValN(BenchRepl, "repl",
+                          "Latency of each top-level expression evaluated the "
+                          "way the REPL does it"),
+               clEnumValN(BenchArrays, "arrays",
+                          "Throughput of 'for' loops over arrays"),
+               clEnumValN(BenchTailCalls, "tailcalls",
+                          "Deep self-recursion in tail position, against "
+                          "the same count as a 'for' loop"),
+               clEnumValN(BenchOperators, "operators",
+                          "A loop using user-defined operators, against the "
+                          "same loop using the built-in ones"),
+               clEnumValN(BenchParfor, "parfor",
+                          "One parfor loop on 1, 2, 4, 8 and 16 threads"),
+               clEnumValN(BenchFastMath, "fastmath",
+                          "Dot product and polynomial kernels over arrays, "
+                          "strict and 'fastmath'")));
+
+static cl::opt<bool>
+    Batch("batch",
+          cl::desc("Compile the whole input as one program: collect all "
+                   "definitions into one module, optimize and JIT it once, "
+                   "then run the top-level expressions in order"));
+
+static cl::opt<std::string> EmitObj(
+    "emit-obj",
+    cl::desc("Compile the definitions in the input ahead of time into a "
+             "relocatable object file, plus a C header declaring them next to "
+             "it, instead of running anything"),
+    cl::value_desc("file"));
+
+static cl::opt<unsigned> BatchChunkSize(
+    "batch-chunk-size",
+    cl::desc("In -batch mode, start a new module every N definitions "
+             "(0 means a single module)"),
+    cl::init(0));
+
+static cl::opt<bool> WholeProgram(
+    "whole-program",
+    cl::desc("Let optimizations cross definitions in a -batch program "
+             "compiled as a single module: small definitions are always "
+             "inlined, and everything but the top-level expressions is "
+             "internalized for the interprocedural passes"));
+
+static cl::opt<bool> SimplifyAST(
+    "simplify-ast",
+    cl::desc("Fold constants and drop identities and dead 'if' branches in "
+             "each item's AST before it is compiled or interpreted"),
+    cl::init(true));
+
+static cl::opt<bool>
+    Lazy("lazy", cl::desc("Keep definitions as ASTs and only compile them "
+                          "once code that is about to run refers to them"));
+
+static cl::opt<unsigned> CompileThreads(
+    "compile-threads",
+    cl::desc("Optimize and compile each module on a pool of N threads while "
+             "parsing continues; only running code waits for them "
+             "(0 compiles on the main thread)"),
+    cl::init(0));
+
+static cl::opt<unsigned> ParforThreads(
+    "parfor-threads",
+    cl::desc("Run parfor loops on N threads (0 means one per core, at most "
+             "256); parforthreads(n) changes this while the program runs"),
+    cl::init(0));
+
+static cl::opt<char>
+    OptLevel("O",
+             cl::desc("Optimization level: -O0, -O1, -O2 or -O3 runs LLVM's "
+                      "standard pipeline for that level over every module, "
+                      "inliner and vectorizers included (default: the "
+                      "tutorial's function passes)"),
+             cl::Prefix, cl::ZeroOrMore, cl::init(' '));
+
+static cl::opt<bool> FastMath(
+    "fast-math",
+    cl::desc("Compile every definition as if it were declared 'fastmath': "
+             "floating point may be reassociated, contracted into FMAs and "
+             "assumed free of NaNs, infinities and signed zeros"));
+
+static cl::opt<bool> FPContract(
+    "fp-contract",
+    cl::desc("Let the backend fuse a multiply and an add into one FMA "
+             "instruction everywhere, without the rest of -fast-math"));
+
+static bool hasOptLevel() { return OptLevel != ' '; }
+static unsigned getOptLevel() { return OptLevel - '0'; }
+
+/// optimizeWholeModules - Whether passes run over a module when it is handed to
+/// the JIT rather than on each function as it is generated.
+static bool optimizeWholeModules() {
+  return Batch || CompileThreads || hasOptLevel();
+}
+
+static cl::opt<bool>
+    Tiered("tiered",
+           cl::desc("Evaluate top-level expressions with an AST interpreter "
+                    "and only JIT functions once they get hot; expressions "
+                    "with loops are JIT'd right away"));
+
+static cl::opt<unsigned> TierThreshold(
+    "tier-threshold",
+    cl::desc("In -tiered mode, compile a function once its interpreted calls "
+             "plus loop trips reach N"),
+    cl::init(1000));
+
+static cl::opt<std::string>
+    CacheDir("cache-dir",
+             cl::desc("Keep compiled objects in this directory and reuse "
+                      "them on later runs"),
+             cl::value_desc("directory"));
+
+static cl::opt<std::string> ProfileGenerate(
+    "profile-generate",
+    cl::desc("Count how often compiled definitions are called and which way "
+             "their branches go, and write the counts to this file at exit"),
+    cl::value_desc("file"));
+
+static cl::opt<std::string>
+    ProfileUse("profile-use",
+               cl::desc("Weight branches and calls with the counts a "
+                        "-profile-generate run wrote to this file"),
+               cl::value_desc("file"));
+
+static cl::opt<unsigned> MemoSize(
+    "memo-size",
+    cl::desc("Number of results each memo function remembers"),
+    cl::init(1 << 16));
+
+static cl::opt<bool>
+    ReportMemo("report-memo",
+               cl::desc("Print how often each memo function found its "
+                        "result remembered, at exit"));
+
+static cl::opt<bool>
+    ReportCompileTime("report-compile-time",
+                      cl::desc("Print the total time spent compiling at exit "
+                               "(always on with -batch)"));
+
+static cl::opt<bool>
+    TimeReport("time-report",
+               cl::desc("Print the time spent and work done in each phase, "
+                        "from parsing to running top-level expressions, at "
+                        "exit"));
+
+static cl::opt<std::string> TimeReportJSON(
+    "time-report-json",
+    cl::desc("Write the -time-report figures to this file as JSON ('-' for "
+             "standard output)"),
+    cl::value_desc("file"));
+
+static cl::opt<bool>
+    ReportLoops("report-loops",
+                cl::desc("Print each loop the vectorizer or unroller "
+                         "transformed, and each loop hint they could not "
+                         "follow"));
+
+static cl::opt<unsigned>
+    BenchSize("bench-size",
+              cl::desc("Size in MB of the generated benchmark input, used "
+                       "when no input file is given"),
+              cl::init(16));
+
+static cl::opt<unsigned>
+    BenchLines("bench-lines",
+               cl::desc("Number of expressions in the generated -bench=repl "
+                        "input, used when no input file is given"),
+               cl::init(10000));
+
+static cl::opt<unsigned>
+    BenchElements("bench-elements",
+                  cl::desc("Array length for -bench=arrays and "
+                           "-bench=fastmath"),
+                  cl::init(1 << 20));
+
+static cl::opt<unsigned>
+    BenchTrips("bench-trips",
+               cl::desc("Loop trip count for -bench=operators"),
+               cl::init(100000000));
+
+static cl::opt<unsigned>
+    BenchDepth("bench-depth",
+               cl::desc("Recursion depth for -bench=tailcalls"),
+               cl::init(10000000));
+
+typedef std::chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point Start) {
+  return std::chrono::duration<double>(Clock::now() - Start).count();
+}
+
+//===----------------------------------------------------------------------===//
+// Phase statistics
+//===----------------------------------------------------------------------===//
+
+/// Phase - The stages an item goes through, for -time-report.
+enum Phase { PhaseParse, PhaseCodegen, PhaseOptimize, PhaseJIT, PhaseExecute };
+static const char *const PhaseNames[] = {"parse", "codegen", "optimize", "jit",
+                                         "execute"};
+static const unsigned NumPhases = array_lengthof(PhaseNames);
+
+/// PhaseStats - Wall time spent in a phase, and how many times it ran: items
+/// parsed, functions generated, functions or modules optimized, modules
+/// compiled and top-level expressions run.
+struct PhaseStats {
+  double Seconds = 0;
+  uint64_t Count = 0;
+};
+static PhaseStats Phases[NumPhases];
+static std::mutex PhaseMutex; // Compile threads optimize concurrently.
+
+/// Work counted along the way.  AST nodes are counted by newNode; IR
+/// instructions are counted before and after each optimizer run.
+static uint64_t NumTokens;
+static uint64_t NumInstsBeforeOpt, NumInstsAfterOpt;
+
+/// How long each top-level expression ran, in order.
+static std::vector<double> ExprSeconds;
+
+/// addPhaseTime - Account for Count more runs of phase P, taking Secs.
+static void addPhaseTime(Phase P, double Secs, unsigned Count = 1) {
+  std::lock_guard<std::mutex> Lock(PhaseMutex);
+  Phases[P].Seconds += Secs;
+  Phases[P].Count += Count;
+}
+
+/// PhaseTimer - Adds the time until it goes out of scope to phase P, as Count
+/// more runs of it.
+class PhaseTimer {
+  Phase P;
+  unsigned Count;
+  Clock::time_point Start = Clock::now();
+
+public:
+  explicit PhaseTimer(Phase P, unsigned Count = 1) : P(P), Count(Count) {}
+  ~PhaseTimer() { addPhaseTime(P, secondsSince(Start), Count); }
+};
+
+/// recordExecution - Account for a top-level expression that ran for Secs.
+static void recordExecution(double Secs) {
+  addPhaseTime(PhaseExecute, Secs);
+  ExprSeconds.push_back(Secs);
+}
+
+//===----------------------------------------------------------------------===//
+// Source input
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+/// SourceReader - Holds the text the lexer is working on.  Files and piped
+/// input are mapped (or read) whole, so tokens can be handed out as views into
+/// one buffer.  A terminal is read one line at a time instead, so the REPL
+/// still answers as soon as a line is typed; a token never spans a refill
+/// because refills only happen after a newline.
+class SourceReader {
+  std::unique_ptr<MemoryBuffer> Buffer;
+  std::string Line;
+  const char *Cur = "";
+  const char *End = Cur;
+  bool Interactive = false;
+
+  bool refill() {
+    if (!Interactive)
+      return false;
+
+    Line.clear();
+    char Chunk[256];
+    while (fgets(Chunk, sizeof(Chunk), stdin)) {
+      Line += Chunk;
+      if (Line.back() == '\n')
+        break;
+    }
+    if (Line.empty())
+      return false;
+    // Keep the "no token spans a refill" invariant at EOF mid-line too.
+    if (Line.back() != '\n')
+      Line += '\n';
+
+    Cur = Line.data();
+    End = Cur + Line.size();
+    return true;
+  }
+
+public:
+  /// open - Start reading Filename ("-" is stdin).  Returns false and prints a
+  /// diagnostic if it can't be read.
+  bool open(StringRef Filename) {
+    if (Filename == "-" && sys::Process::StandardInIsUserInput()) {
+      Interactive = true;
+      return true;
+    }
+
+    auto BufOrErr = MemoryBuffer::getFileOrSTDIN(Filename);
+    if (std::error_code EC = BufOrErr.getError()) {
+      fprintf(stderr, "Error: can't read '%s': %s\n", Filename.str().c_str(),
+              EC.message().c_str());
+      return false;
+    }
+    setBuffer(std::move(*BufOrErr));
+    return true;
+  }
+
+  void setBuffer(std::unique_ptr<MemoryBuffer> Buf) {
+    Buffer = std::move(Buf);
+    Interactive = false;
+    Cur = Buffer->getBufferStart();
+    End = Buffer->getBufferEnd();
+  }
+
+  /// peek - Return the next character without consuming it, or EOF.
+  int peek() {
+    if (Cur == End && !refill())
+      return EOF;
+    return (unsigned char)*Cur;
+  }
+
+  void advance() { ++Cur; }
+
+  size_t getBufferSize() const { return Buffer ? Buffer->getBufferSize() : 0; }
+
+  /// lexWhile - Consume the run of characters satisfying Pred, starting at the
+  /// current one, and return it as a view into the buffer.
+  template <typename PredT> StringRef lexWhile(PredT Pred) {
+    const char *Start = Cur;
+    while (Cur != End && Pred((unsigned char)*Cur))
+      ++Cur;
+    return StringRef(Start, Cur - Start);
+  }
+};
+
+} // end anonymous namespace
+
+static SourceReader Source;
+
+//===----------------------------------------------------------------------===//
+// Keywords and identifiers
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+/// SymbolID - Small integer naming an interned identifier.  Everything after
+/// the lexer refers to names by ID, so the parser and code generator never
+/// hash or copy identifier strings.
+typedef unsigned SymbolID;
+
+/// SymbolTable - Interns identifiers.  Each distinct spelling is stored once
+/// and gets the next ID.
+class SymbolTable {
+  StringMap<SymbolID> IDs;
+  std::vector<StringRef> Names; // Point at the keys owned by IDs.
+
+public:
+  SymbolID intern(StringRef Name) {
+    auto Result = IDs.insert(std::make_pair(Name, (SymbolID)Names.size()));
+    if (Result.second)
+      Names.push_back(Result.first->getKey());
+    return Result.first->getValue();
+  }
+
+  StringRef getName(SymbolID ID) const { return Names[ID]; }
+};
+
+/// KeywordInfo - One entry of the keyword table.
+struct KeywordInfo {
+  const char *Name;
+  size_t Len;
+  int Tok;
+};
+
+} // end anonymous namespace
+
+static SymbolTable Symbols;
+static const SymbolID AnonExprID = Symbols.intern("__anon_expr");
+static const StringRef AnonExprName = Symbols.getName(AnonExprID);
+static const SymbolID DoubleTypeID = Symbols.intern("double");
+static const SymbolID IntTypeID = Symbols.intern("int");
+static const SymbolID Vec4TypeID = Symbols.intern("vec4");
+static const SymbolID ArrayTypeID = Symbols.intern("array");
+static const SymbolID LenID = Symbols.intern("len");
+static const SymbolID UnrollID = Symbols.intern("unroll");
+static const SymbolID VectorizeID = Symbols.intern("vectorize");
+static const SymbolID InterleaveID = Symbols.intern("interleave");
+static const SymbolID ParallelID = Symbols.intern("parallel");
+static const SymbolID ReduceID = Symbols.intern("reduce");
+static const SymbolID MemoID = Symbols.intern("memo");
+static const SymbolID FastMathID = Symbols.intern("fastmath");
+
+/// getOperatorID - ID of the function implementing a user-defined operator,
+/// e.g. "binary|".  Cached so operator uses don't build a string each time.
+static SymbolID getOperatorID(bool IsBinary, unsigned char Op) {
+  static SymbolID Cache[2][256]; // ID + 1, or zero if not interned yet.
+  SymbolID &Entry = Cache[IsBinary][Op];
+  if (!Entry)
+    Entry = Symbols.intern((IsBinary ? "binary" : "unary") +
+                           std::string(1, (char)Op)) +
+            1;
+  return Entry - 1;
+}
+
+// The keywords, in any order.  Adding one may require retuning keywordHash; the
+// static_assert below says so if it does.
+static constexpr KeywordInfo Keywords[] = {
+    {"def", 3, tok_def},       {"extern", 6, tok_extern},
+    {"if", 2, tok_if},         {"then", 4, tok_then},
+    {"else", 4, tok_else},     {"for", 3, tok_for},
+    {"in", 2, tok_in},         {"binary", 6, tok_binary},
+    {"unary", 5, tok_unary},   {"var", 3, tok_var},
+    {"parfor", 6, tok_parfor}};
+static constexpr unsigned NumKeywords = sizeof(Keywords) / sizeof(Keywords[0]);
+static constexpr unsigned KeywordTableSize = 32;
+
+/// keywordHash - Perfect hash of the keyword set, from the length and the
+/// first and last characters.
+static constexpr unsigned keywordHash(const char *S, size_t Len) {
+  return (Len * 2 + (unsigned char)S[0] * 3 + (unsigned char)S[Len - 1]) &
+         (KeywordTableSize - 1);
+}
+
+static constexpr unsigned keywordSlot(unsigned K) {
+  return keywordHash(Keywords[K].Name, Keywords[K].Len);
+}
+
+static constexpr bool slotCollides(unsigned K, unsigned Other) {
+  return Other < NumKeywords &&
+         (keywordSlot(K) == keywordSlot(Other) || slotCollides(K, Other + 1));
+}
+
+static constexpr bool isPerfectHash(unsigned K) {
+  return K >= NumKeywords || (!slotCollides(K, K + 1) && isPerfectHash(K + 1));
+}
+
+static_assert(isPerfectHash(0), "keywordHash has collisions; retune it");
+
+/// keywordInSlot - Index into Keywords of the keyword hashing to Slot, or
+/// NumKeywords if the slot is empty.
+static constexpr unsigned keywordInSlot(unsigned Slot, unsigned K = 0) {
+  return K >= NumKeywords || keywordSlot(K) == Slot ? K
+                                                     : keywordInSlot(Slot, K + 1);
+}
+
+// Slot -> keyword index, computed entirely at compile time.
+static constexpr unsigned char KeywordTable[KeywordTableSize] = {
+    keywordInSlot(0),  keywordInSlot(1),  keywordInSlot(2),  keywordInSlot(3),
+    keywordInSlot(4),  keywordInSlot(5),  keywordInSlot(6),  keywordInSlot(7),
+    keywordInSlot(8),  keywordInSlot(9),  keywordInSlot(10), keywordInSlot(11),
+    keywordInSlot(12), keywordInSlot(13), keywordInSlot(14), keywordInSlot(15),
+    keywordInSlot(16), keywordInSlot(17), keywordInSlot(18), keywordInSlot(19),
+    keywordInSlot(20), keywordInSlot(21), keywordInSlot(22), keywordInSlot(23),
+    keywordInSlot(24), keywordInSlot(25), keywordInSlot(26), keywordInSlot(27),
+    keywordInSlot(28), keywordInSlot(29), keywordInSlot(30), keywordInSlot(31)};
+
+/// lookupKeyword - Return the keyword token spelled by Str, or tok_identifier.
+/// One hash and at most one compare.
+static int lookupKeyword(StringRef Str) {
+  unsigned K = KeywordTable[keywordHash(Str.data(), Str.size())];
+  if (K < NumKeywords && Str.size() == Keywords[K].Len &&
+      memcmp(Str.data(), Keywords[K].Name, Keywords[K].Len) == 0)
+    return Keywords[K].Tok;
+  return tok_identifier;
+}
+
+static StringRef IdentifierStr; // Filled in if tok_identifier
+static SymbolID IdentifierID;   // Filled in if tok_identifier
+static double NumVal;           // Filled in if tok_number
+
+static bool isIdentifierChar(int C) { return isalnum(C); }
+static bool isNumberChar(int C) { return isdigit(C) || C == '.'; }
+
+/// parseNumber - strtod on a view.  Number tokens are short, so copying into a
+/// local buffer is cheaper than building a std::string.
+static double parseNumber(StringRef NumStr) {
+  char Buf[64];
+  if (NumStr.size() >= sizeof(Buf))
+    return strtod(NumStr.str().c_str(), nullptr);
+  memcpy(Buf, NumStr.data(), NumStr.size());
+  Buf[NumStr.size()] = '\0';
+  return strtod(Buf, nullptr);
+}
 
-/// gettok - Return the next token from standard input.
+/// gettok - Return the next token from the source buffer.
 static int gettok() {
-  static int LastChar = ' ';
+  int LastChar = Source.peek();
 
   // Skip any whitespace.
-  while (isspace(LastChar))
-    LastChar = getchar();
+  while (isspace(LastChar)) {
+    Source.advance();
+    LastChar = Source.peek();
+  }
 
   if (isalpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
-    IdentifierStr = LastChar;
-    while (isalnum((LastChar = getchar())))
-      IdentifierStr += LastChar;
-
-    if (IdentifierStr == "def")
-      return tok_def;
-    if (IdentifierStr == "extern")
-      return tok_extern;
-    if (IdentifierStr == "if")
-      return tok_if;
-    if (IdentifierStr == "then")
-      return tok_then;
-    if (IdentifierStr == "else")
-      return tok_else;
-    if (IdentifierStr == "for")
-      return tok_for;
-    if (IdentifierStr == "in")
-      return tok_in;
-    if (IdentifierStr == "binary")
-      return tok_binary;
-    if (IdentifierStr == "unary")
-      return tok_unary;
-    if (IdentifierStr == "var")
-      return tok_var;
-    return tok_identifier;
-  }
-
-  if (isdigit(LastChar) || LastChar == '.') { // Number: [0-9.]+
-    std::string NumStr;
-    do {
-      NumStr += LastChar;
-      LastChar = getchar();
-    } while (isdigit(LastChar) || LastChar == '.');
+    IdentifierStr = Source.lexWhile(isIdentifierChar);
+
+    int Tok = lookupKeyword(IdentifierStr);
+    if (Tok == tok_identifier)
+      IdentifierID = Symbols.intern(IdentifierStr);
+    return Tok;
+  }
 
-    NumVal = strtod(NumStr.c_str(), nullptr);
+  if (isNumberChar(LastChar)) { // Number: [0-9.]+
+    NumVal = parseNumber(Source.lexWhile(isNumberChar));
     return tok_number;
   }
 
   if (LastChar == '#') {
     // Comment until end of line.
-    do
-      LastChar = getchar();
-    while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+    do {
+      Source.advance();
+      LastChar = Source.peek();
+    } while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
     if (LastChar != EOF)
       return gettok();
@@ -128,9 +653,8 @@ static int gettok() {
     return tok_eof;
 
   // Otherwise, just return the character as its ascii value.
-  int ThisChar = LastChar;
-  LastChar = getchar();
-  return ThisChar;
+  Source.advance();
+  return LastChar;
 }
 
 //===----------------------------------------------------------------------===//
@@ -139,12 +663,69 @@ static int gettok() {
 
 namespace {
 
-/// ExprAST - Base class for all expression nodes.
+class FunctionAST;
+class MemoTable;
+
+/// TypeKind - The type of a value.  Everything is a double unless a prototype
+/// says otherwise; a 'var' takes the type of its initializer.  An int is a
+/// 64-bit integer.  A vec4 is four doubles operated on lane-wise, i.e. one AVX
+/// register.  An array is a reference to doubles on the heap (see KArray in
+/// the runtime).
+enum TypeKind { TK_Double, TK_Int, TK_Vec4, TK_Array };
+
+/// EvalFrame - The variables of one activation in the interpreter tier.  Later
+/// bindings shadow earlier ones with the same name.
+struct EvalFrame {
+  FunctionAST *Fn;
+  SmallVector<std::pair<SymbolID, double>, 8> Vars;
+
+  explicit EvalFrame(FunctionAST *Fn) : Fn(Fn) {}
+
+  double *lookup(SymbolID Name) {
+    for (auto I = Vars.rbegin(), E = Vars.rend(); I != E; ++I)
+      if (I->first == Name)
+        return &I->second;
+    return nullptr;
+  }
+};
+
+/// ExprAST - Base class for all expression nodes.  Nodes live in the arena of
+/// the top-level item they were parsed for and are never destroyed one by one:
+/// the arena is released as a whole, so nodes must stay trivially
+/// destructible and may only point at other memory in the same arena.
 class ExprAST {
-public:
-  virtual ~ExprAST() = default;
+protected:
+  ~ExprAST() = default;
 
+public:
   virtual Value *codegen() = 0;
+  virtual double eval(EvalFrame &Frame) = 0;
+
+  /// codegenAssign - Store Val into the place this expression names.  Only
+  /// variables and lanes of them can be assigned to.
+  virtual Value *codegenAssign(Value *Val);
+
+  /// evalAssign - The interpreter's codegenAssign: store Val into the
+  /// variable this expression names.
+  virtual double evalAssign(EvalFrame &Frame, double Val);
+
+  /// codegenReturn - Emit this expression as the body of the function being
+  /// generated and return its value.  Expressions that pass a tail position
+  /// on to a subexpression return from each branch themselves, so that calls
+  /// in tail position end up right before a 'ret'.
+  virtual bool codegenReturn();
+
+  /// getLiteral - If this is a number literal, set Val to its value.
+  virtual bool getLiteral(double &Val) const { return false; }
+
+  /// forEachChild - Call Fn on each subexpression slot.  Fn may store a
+  /// different expression into the slot.
+  virtual void forEachChild(function_ref<void(ExprAST *&)> Fn) {}
+
+  /// fold - An expression computing the same value as this one with fewer
+  /// nodes, given that the subexpressions have been simplified already, or
+  /// this node itself.
+  virtual ExprAST *fold() { return this; }
 };
 
 /// NumberExprAST - Expression class for numeric literals like "1.0".
@@ -155,138 +736,353 @@ public:
   NumberExprAST(double Val) : Val(Val) {}
 
   Value *codegen() override;
+  double eval(EvalFrame &Frame) override;
+  bool getLiteral(double &V) const override {
+    V = Val;
+    return true;
+  }
 };
 
 /// VariableExprAST - Expression class for referencing a variable, like "a".
 class VariableExprAST : public ExprAST {
-  std::string Name;
+  SymbolID Name;
 
 public:
-  VariableExprAST(const std::string &Name) : Name(Name) {}
+  VariableExprAST(SymbolID Name) : Name(Name) {}
 
   Value *codegen() override;
-  const std::string &getName() const { return Name; }
+  double eval(EvalFrame &Frame) override;
+  Value *codegenAssign(Value *Val) override;
+  double evalAssign(EvalFrame &Frame, double Val) override;
+  SymbolID getName() const { return Name; }
 };
 
 /// UnaryExprAST - Expression class for a unary operator.
 class UnaryExprAST : public ExprAST {
   char Opcode;
-  std::unique_ptr<ExprAST> Operand;
+  ExprAST *Operand;
 
 public:
-  UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand)
-      : Opcode(Opcode), Operand(std::move(Operand)) {}
+  UnaryExprAST(char Opcode, ExprAST *Operand)
+      : Opcode(Opcode), Operand(Operand) {}
 
   Value *codegen() override;
+  double eval(EvalFrame &Frame) override;
+  void forEachChild(function_ref<void(ExprAST *&)> Fn) override {
+    Fn(Operand);
+  }
 };
 
 /// BinaryExprAST - Expression class for a binary operator.
 class BinaryExprAST : public ExprAST {
   char Op;
-  std::unique_ptr<ExprAST> LHS, RHS;
+  ExprAST *LHS, *RHS;
 
 public:
-  BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
-                std::unique_ptr<ExprAST> RHS)
-      : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+  BinaryExprAST(char Op, ExprAST *LHS, ExprAST *RHS)
+      : Op(Op), LHS(LHS), RHS(RHS) {}
 
   Value *codegen() override;
+  double eval(EvalFrame &Frame) override;
+  void forEachChild(function_ref<void(ExprAST *&)> Fn) override {
+    Fn(LHS);
+    Fn(RHS);
+  }
+  ExprAST *fold() override;
 };
 
 /// CallExprAST - Expression class for function calls.
 class CallExprAST : public ExprAST {
-  std::string Callee;
-  std::vector<std::unique_ptr<ExprAST>> Args;
+  SymbolID Callee;
+  ArrayRef<ExprAST *> Args;
+
+public:
+  CallExprAST(SymbolID Callee, ArrayRef<ExprAST *> Args)
+      : Callee(Callee), Args(Args) {}
+
+  Value *codegen() override;
+  double eval(EvalFrame &Frame) override;
+  bool codegenReturn() override;
+  void forEachChild(function_ref<void(ExprAST *&)> Fn) override {
+    // The list lives in the item's arena like the node itself.
+    for (ExprAST *&Arg : makeMutableArrayRef(
+             const_cast<ExprAST **>(Args.data()), Args.size()))
+      Fn(Arg);
+  }
+};
+
+/// VectorExprAST - Expression class for vec4 literals like "vec4(1, 2, 3, 4)",
+/// or "vec4(x)" for all lanes the same.
+class VectorExprAST : public ExprAST {
+  ArrayRef<ExprAST *> Elts;
+
+public:
+  VectorExprAST(ArrayRef<ExprAST *> Elts) : Elts(Elts) {}
+
+  Value *codegen() override;
+  double eval(EvalFrame &Frame) override;
+  void forEachChild(function_ref<void(ExprAST *&)> Fn) override {
+    for (ExprAST *&Elt : makeMutableArrayRef(
+             const_cast<ExprAST **>(Elts.data()), Elts.size()))
+      Fn(Elt);
+  }
+};
+
+/// IntExprAST - Expression class for converting to an int, like "int(x)".
+/// Doubles are rounded toward zero.
+class IntExprAST : public ExprAST {
+  ExprAST *Operand;
+
+public:
+  IntExprAST(ExprAST *Operand) : Operand(Operand) {}
+
+  Value *codegen() override;
+  double eval(EvalFrame &Frame) override;
+  void forEachChild(function_ref<void(ExprAST *&)> Fn) override { Fn(Operand); }
+};
+
+/// ArrayExprAST - Expression class for allocating an array, like "array(n)".
+class ArrayExprAST : public ExprAST {
+  ExprAST *Length;
+
+public:
+  ArrayExprAST(ExprAST *Length) : Length(Length) {}
+
+  Value *codegen() override;
+  double eval(EvalFrame &Frame) override;
+  void forEachChild(function_ref<void(ExprAST *&)> Fn) override { Fn(Length); }
+};
+
+/// LengthExprAST - Expression class for the length of an array, "len(a)".
+class LengthExprAST : public ExprAST {
+  ExprAST *Array;
+
+public:
+  LengthExprAST(ExprAST *Array) : Array(Array) {}
+
+  Value *codegen() override;
+  double eval(EvalFrame &Frame) override;
+  void forEachChild(function_ref<void(ExprAST *&)> Fn) override { Fn(Array); }
+};
+
+/// IndexExprAST - Expression class for a vec4 lane or an array element, like
+/// "v[2]".
+class IndexExprAST : public ExprAST {
+  ExprAST *Vec, *Index;
 
 public:
-  CallExprAST(const std::string &Callee,
-              std::vector<std::unique_ptr<ExprAST>> Args)
-      : Callee(Callee), Args(std::move(Args)) {}
+  IndexExprAST(ExprAST *Vec, ExprAST *Index) : Vec(Vec), Index(Index) {}
 
   Value *codegen() override;
+  double eval(EvalFrame &Frame) override;
+  Value *codegenAssign(Value *Val) override;
+  void forEachChild(function_ref<void(ExprAST *&)> Fn) override {
+    Fn(Vec);
+    Fn(Index);
+  }
 };
 
 /// IfExprAST - Expression class for if/then/else.
 class IfExprAST : public ExprAST {
-  std::unique_ptr<ExprAST> Cond, Then, Else;
+  ExprAST *Cond, *Then, *Else;
 
 public:
-  IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then,
-            std::unique_ptr<ExprAST> Else)
-      : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
+  IfExprAST(ExprAST *Cond, ExprAST *Then, ExprAST *Else)
+      : Cond(Cond), Then(Then), Else(Else) {}
 
   Value *codegen() override;
+  double eval(EvalFrame &Frame) override;
+  bool codegenReturn() override;
+  void forEachChild(function_ref<void(ExprAST *&)> Fn) override {
+    Fn(Cond);
+    Fn(Then);
+    Fn(Else);
+  }
+  ExprAST *fold() override;
+};
+
+/// LoopHints - What a 'for' loop asks of the optimizer.  Zero leaves a count
+/// to the pass's own cost model.
+struct LoopHints {
+  unsigned Unroll = 0;
+  unsigned VectorizeWidth = 0;
+  unsigned Interleave = 0;
+  bool Parallel = false; // No iteration touches memory another one does.
+
+  bool empty() const {
+    return !Unroll && !VectorizeWidth && !Interleave && !Parallel;
+  }
 };
 
 /// ForExprAST - Expression class for for/in.
 class ForExprAST : public ExprAST {
-  std::string VarName;
-  std::unique_ptr<ExprAST> Start, End, Step, Body;
+  SymbolID VarName;
+  ExprAST *Start, *End, *Step, *Body;
+  LoopHints Hints;
+
+  MDNode *createLoopID();
+
+public:
+  ForExprAST(SymbolID VarName, ExprAST *Start, ExprAST *End, ExprAST *Step,
+             ExprAST *Body, const LoopHints &Hints)
+      : VarName(VarName), Start(Start), End(End), Step(Step), Body(Body),
+        Hints(Hints) {}
+
+  Value *codegen() override;
+  double eval(EvalFrame &Frame) override;
+  void forEachChild(function_ref<void(ExprAST *&)> Fn) override {
+    Fn(Start);
+    Fn(End);
+    if (Step)
+      Fn(Step);
+    Fn(Body);
+  }
+};
+
+/// ParForExprAST - Expression class for parfor/in.  The body is outlined into
+/// a function of its own, which the runtime calls on a range of iterations
+/// from each of its threads.
+class ParForExprAST : public ExprAST {
+  SymbolID VarName;
+  ExprAST *Start, *End, *Body;
+  char Reduce; // '+', '*', or 0 for none.
+
+  Function *codegenOutlined(StructType *EnvTy,
+                            ArrayRef<std::pair<SymbolID, AllocaInst *>> Captures,
+                            Type *VarTy);
 
 public:
-  ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start,
-             std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step,
-             std::unique_ptr<ExprAST> Body)
-      : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
-        Step(std::move(Step)), Body(std::move(Body)) {}
+  ParForExprAST(SymbolID VarName, ExprAST *Start, ExprAST *End, ExprAST *Body,
+                char Reduce)
+      : VarName(VarName), Start(Start), End(End), Body(Body), Reduce(Reduce) {}
 
   Value *codegen() override;
+  double eval(EvalFrame &Frame) override;
+  void forEachChild(function_ref<void(ExprAST *&)> Fn) override {
+    Fn(Start);
+    Fn(End);
+    Fn(Body);
+  }
 };
 
+typedef std::pair<SymbolID, ExprAST *> VarBinding;
+
 /// VarExprAST - Expression class for var/in
 class VarExprAST : public ExprAST {
-  std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
-  std::unique_ptr<ExprAST> Body;
+  ArrayRef<VarBinding> VarNames;
+  ExprAST *Body;
+
+  bool bindVars(std::vector<AllocaInst *> &OldBindings);
+  void unbindVars(ArrayRef<AllocaInst *> OldBindings);
 
 public:
-  VarExprAST(
-      std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames,
-      std::unique_ptr<ExprAST> Body)
-      : VarNames(std::move(VarNames)), Body(std::move(Body)) {}
+  VarExprAST(ArrayRef<VarBinding> VarNames, ExprAST *Body)
+      : VarNames(VarNames), Body(Body) {}
 
   Value *codegen() override;
+  double eval(EvalFrame &Frame) override;
+  bool codegenReturn() override;
+  void forEachChild(function_ref<void(ExprAST *&)> Fn) override {
+    for (VarBinding &Var : makeMutableArrayRef(
+             const_cast<VarBinding *>(VarNames.data()), VarNames.size()))
+      if (Var.second)
+        Fn(Var.second);
+    Fn(Body);
+  }
 };
 
 /// PrototypeAST - This class represents the "prototype" for a function,
 /// which captures its name, and its argument names (thus implicitly the number
 /// of arguments the function takes), as well as if it is an operator.
 class PrototypeAST {
-  std::string Name;
-  std::vector<std::string> Args;
+  SymbolID Name;
+  std::vector<SymbolID> Args;
   bool IsOperator;
   unsigned Precedence; // Precedence if a binary op.
+  std::vector<TypeKind> ArgTypes; // Empty if all arguments are doubles.
+  TypeKind ReturnType;
+  bool IsMemo = false;
+  bool IsFastMath = false;
 
 public:
-  PrototypeAST(const std::string &Name, std::vector<std::string> Args,
-               bool IsOperator = false, unsigned Prec = 0)
+  PrototypeAST(SymbolID Name, std::vector<SymbolID> Args,
+               bool IsOperator = false, unsigned Prec = 0,
+               std::vector<TypeKind> ArgTypes = std::vector<TypeKind>(),
+               TypeKind ReturnType = TK_Double)
       : Name(Name), Args(std::move(Args)), IsOperator(IsOperator),
-        Precedence(Prec) {}
+        Precedence(Prec), ArgTypes(std::move(ArgTypes)),
+        ReturnType(ReturnType) {}
 
   Function *codegen();
-  const std::string &getName() const { return Name; }
+  SymbolID getName() const { return Name; }
+  ArrayRef<SymbolID> getArgs() const { return Args; }
+  TypeKind getArgType(unsigned i) const {
+    return ArgTypes.empty() ? TK_Double : ArgTypes[i];
+  }
+  TypeKind getReturnType() const { return ReturnType; }
+
+  /// hasTypedValues - Whether any argument or the result is not a double.
+  bool hasTypedValues() const {
+    return ReturnType != TK_Double ||
+           std::count(ArgTypes.begin(), ArgTypes.end(), TK_Double) !=
+               (ptrdiff_t)ArgTypes.size();
+  }
 
   bool isUnaryOp() const { return IsOperator && Args.size() == 1; }
   bool isBinaryOp() const { return IsOperator && Args.size() == 2; }
 
+  /// isMemo - Whether the function was declared 'memo': it promises to be
+  /// pure, so its results can be remembered by argument.
+  bool isMemo() const { return IsMemo; }
+  void setMemo() { IsMemo = true; }
+
+  /// isFastMath - Whether the function was declared 'fastmath': its floating
+  /// point may be reassociated and contracted as if it were real arithmetic.
+  bool isFastMath() const { return IsFastMath; }
+  void setFastMath() { IsFastMath = true; }
+
   char getOperatorName() const {
     assert(isUnaryOp() || isBinaryOp());
-    return Name[Name.size() - 1];
+    return Symbols.getName(Name).back();
   }
 
   unsigned getBinaryPrecedence() const { return Precedence; }
 };
 
-/// FunctionAST - This class represents a function definition itself.
+/// FunctionAST - This class represents a function definition itself.  It owns
+/// the arena its body was parsed into.
 class FunctionAST {
   std::unique_ptr<PrototypeAST> Proto;
-  std::unique_ptr<ExprAST> Body;
+  ExprAST *Body;
+  std::unique_ptr<BumpPtrAllocator> Arena;
+  bool HasLoop;
+  bool UsesTypedValues;
+  uint64_t Heat = 0; // Interpreted calls and loop trips so far.
+  MemoTable *Memo = nullptr; // Made on first use.
+
+  bool codegenBody(Function *F);
+  bool codegenPlainBody(Function *F);
+  MemoTable &getMemoTable();
 
 public:
-  FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-              std::unique_ptr<ExprAST> Body)
-      : Proto(std::move(Proto)), Body(std::move(Body)) {}
+  FunctionAST(std::unique_ptr<PrototypeAST> Proto, ExprAST *Body,
+              std::unique_ptr<BumpPtrAllocator> Arena, bool HasLoop,
+              bool UsesTypedValues)
+      : Proto(std::move(Proto)), Body(Body), Arena(std::move(Arena)),
+        HasLoop(HasLoop), UsesTypedValues(UsesTypedValues) {}
+  ~FunctionAST();
 
   Function *codegen();
+  Function *codegenInlinable();
+  double interpret(ArrayRef<double> Args);
+  PrototypeAST &getProto() { return *Proto; }
+  bool hasLoop() const { return HasLoop; }
+
+  /// usesTypedValues - Whether values other than doubles may appear anywhere
+  /// in the function.  The interpreter only handles doubles, so such functions
+  /// are always compiled.
+  bool usesTypedValues() const { return UsesTypedValues || Proto->hasTypedValues(); }
+  uint64_t addHeat(uint64_t N) { return Heat += N; }
 };
 
 } // end anonymous namespace
@@ -299,7 +1095,10 @@ public:
 /// token the parser is looking at.  getNextToken reads another token from the
 /// lexer and updates CurTok with its results.
 static int CurTok;
-static int getNextToken() { return CurTok = gettok(); }
+static int getNextToken() {
+  ++NumTokens;
+  return CurTok = gettok();
+}
 
 /// BinopPrecedence - This holds the precedence for each binary operator that is
 /// defined.
@@ -317,8 +1116,61 @@ static int GetTokPrecedence() {
   return TokPrec;
 }
 
+/// ParseArena - Where the nodes of the top-level item being parsed go.  The
+/// FunctionAST built for the item takes the arena over; when it is done with
+/// it, the emptied arena waits in SpareArena for the next item, so parsing an
+/// item usually takes no heap allocation at all.
+static std::unique_ptr<BumpPtrAllocator> ParseArena, SpareArena;
+
+/// AST allocation statistics for -bench=parse.
+static uint64_t NumASTNodes, NumASTArenaBytes;
+
+/// How many AST nodes simplifyItem has removed.
+static uint64_t NumSimplifiedNodes;
+
+/// Whether the item being parsed contains a 'for' loop, and whether it may
+/// produce values other than doubles.
+static bool ItemHasLoop;
+static bool ItemUsesTypedValues;
+
+/// BeginItemArena - Get ParseArena ready for a new top-level item, dropping
+/// whatever an item that failed to parse left in it.
+static void BeginItemArena() {
+  if (!ParseArena)
+    ParseArena = std::move(SpareArena);
+  if (!ParseArena)
+    ParseArena = llvm::make_unique<BumpPtrAllocator>();
+  ParseArena->Reset();
+  ItemHasLoop = false;
+  ItemUsesTypedValues = false;
+}
+
+FunctionAST::~FunctionAST() {
+  NumASTArenaBytes += Arena->getBytesAllocated();
+  Arena->Reset();
+  SpareArena = std::move(Arena);
+}
+
+/// newNode - Allocate an AST node in the current item's arena.
+template <typename T, typename... ArgTs> static T *newNode(ArgTs &&... Args) {
+  static_assert(std::is_trivially_destructible<T>::value,
+                "AST nodes are released with their arena, never destroyed");
+  ++NumASTNodes;
+  return new (ParseArena->Allocate<T>()) T(std::forward<ArgTs>(Args)...);
+}
+
+/// copyToArena - Store a list the parser has collected contiguously in the
+/// current item's arena.
+template <typename T> static ArrayRef<T> copyToArena(ArrayRef<T> Elts) {
+  if (Elts.empty())
+    return ArrayRef<T>();
+  T *Mem = ParseArena->Allocate<T>(Elts.size());
+  std::uninitialized_copy(Elts.begin(), Elts.end(), Mem);
+  return makeArrayRef(Mem, Elts.size());
+}
+
 /// LogError* - These are little helper functions for error handling.
-std::unique_ptr<ExprAST> LogError(const char *Str) {
+ExprAST *LogError(const char *Str) {
   fprintf(stderr, "Error: %s\n", Str);
   return nullptr;
 }
@@ -328,17 +1180,18 @@ std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
   return nullptr;
 }
 
-static std::unique_ptr<ExprAST> ParseExpression();
+static ExprAST *ParseExpression();
+static bool hasTypedSignature(SymbolID Name);
 
 /// numberexpr ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-  auto Result = llvm::make_unique<NumberExprAST>(NumVal);
+static ExprAST *ParseNumberExpr() {
+  auto Result = newNode<NumberExprAST>(NumVal);
   getNextToken(); // consume the number
-  return std::move(Result);
+  return Result;
 }
 
 /// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr() {
+static ExprAST *ParseParenExpr() {
   getNextToken(); // eat (.
   auto V = ParseExpression();
   if (!V)
@@ -353,21 +1206,26 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
 /// identifierexpr
 ///   ::= identifier
 ///   ::= identifier '(' expression* ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-  std::string IdName = IdentifierStr;
+///   ::= 'vec4' '(' expression (',' expression ',' expression ',' expression)?
+///       ')'
+///   ::= 'int' '(' expression ')'
+///   ::= 'array' '(' expression ')'
+///   ::= 'len' '(' expression ')'
+static ExprAST *ParseIdentifierExpr() {
+  SymbolID IdName = IdentifierID;
 
   getNextToken(); // eat identifier.
 
   if (CurTok != '(') // Simple variable ref.
-    return llvm::make_unique<VariableExprAST>(IdName);
+    return newNode<VariableExprAST>(IdName);
 
   // Call.
   getNextToken(); // eat (
-  std::vector<std::unique_ptr<ExprAST>> Args;
+  SmallVector<ExprAST *, 8> Args;
   if (CurTok != ')') {
     while (true) {
       if (auto Arg = ParseExpression())
-        Args.push_back(std::move(Arg));
+        Args.push_back(Arg);
       else
         return nullptr;
 
@@ -383,11 +1241,33 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
   // Eat the ')'.
   getNextToken();
 
-  return llvm::make_unique<CallExprAST>(IdName, std::move(Args));
+  if (IdName == Vec4TypeID) {
+    if (Args.size() != 1 && Args.size() != 4)
+      return LogError("vec4 takes 1 or 4 values");
+    ItemUsesTypedValues = true;
+    return newNode<VectorExprAST>(copyToArena<ExprAST *>(Args));
+  }
+
+  if (IdName == IntTypeID || IdName == ArrayTypeID || IdName == LenID) {
+    if (Args.size() != 1)
+      return LogError(IdName == IntTypeID   ? "int takes one value"
+                      : IdName == LenID ? "len takes one array"
+                                        : "array takes one length");
+    ItemUsesTypedValues = true;
+    if (IdName == IntTypeID)
+      return newNode<IntExprAST>(Args[0]);
+    if (IdName == LenID)
+      return newNode<LengthExprAST>(Args[0]);
+    return newNode<ArrayExprAST>(Args[0]);
+  }
+
+  if (hasTypedSignature(IdName))
+    ItemUsesTypedValues = true;
+  return newNode<CallExprAST>(IdName, copyToArena<ExprAST *>(Args));
 }
 
 /// ifexpr ::= 'if' expression 'then' expression 'else' expression
-static std::unique_ptr<ExprAST> ParseIfExpr() {
+static ExprAST *ParseIfExpr() {
   getNextToken(); // eat the if.
 
   // condition.
@@ -412,18 +1292,48 @@ static std::unique_ptr<ExprAST> ParseIfExpr() {
   if (!Else)
     return nullptr;
 
-  return llvm::make_unique<IfExprAST>(std::move(Cond), std::move(Then),
-                                      std::move(Else));
+  return newNode<IfExprAST>(Cond, Then, Else);
+}
+
+/// loophints
+///   ::= (('unroll' | 'vectorize' | 'interleave') number | 'parallel')*
+/// The hint names are only special here, so they stay usable as variables.
+static bool ParseLoopHints(LoopHints &Hints) {
+  while (CurTok == tok_identifier) {
+    SymbolID Hint = IdentifierID;
+    if (Hint == ParallelID) {
+      Hints.Parallel = true;
+      getNextToken();
+      continue;
+    }
+
+    unsigned *Count = Hint == UnrollID       ? &Hints.Unroll
+                      : Hint == VectorizeID  ? &Hints.VectorizeWidth
+                      : Hint == InterleaveID ? &Hints.Interleave
+                                             : nullptr;
+    if (!Count)
+      break;
+    getNextToken();
+    if (CurTok != tok_number || NumVal < 1 || NumVal > 1024 ||
+        NumVal != (unsigned)NumVal) {
+      LogError("expected a count from 1 to 1024 after a loop hint");
+      return false;
+    }
+    *Count = (unsigned)NumVal;
+    getNextToken();
+  }
+  return true;
 }
 
-/// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
-static std::unique_ptr<ExprAST> ParseForExpr() {
+/// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? loophints
+///             'in' expression
+static ExprAST *ParseForExpr() {
   getNextToken(); // eat the for.
 
   if (CurTok != tok_identifier)
     return LogError("expected identifier after for");
 
-  std::string IdName = IdentifierStr;
+  SymbolID IdName = IdentifierID;
   getNextToken(); // eat identifier.
 
   if (CurTok != '=')
@@ -442,7 +1352,7 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
     return nullptr;
 
   // The step value is optional.
-  std::unique_ptr<ExprAST> Step;
+  ExprAST *Step = nullptr;
   if (CurTok == ',') {
     getNextToken();
     Step = ParseExpression();
@@ -450,6 +1360,10 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
       return nullptr;
   }
 
+  LoopHints Hints;
+  if (!ParseLoopHints(Hints))
+    return nullptr;
+
   if (CurTok != tok_in)
     return LogError("expected 'in' after for");
   getNextToken(); // eat 'in'.
@@ -458,27 +1372,77 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
   if (!Body)
     return nullptr;
 
-  return llvm::make_unique<ForExprAST>(IdName, std::move(Start), std::move(End),
-                                       std::move(Step), std::move(Body));
+  ItemHasLoop = true;
+  return newNode<ForExprAST>(IdName, Start, End, Step, Body, Hints);
+}
+
+/// parforexpr ::= 'parfor' identifier '=' expr ',' expr ('reduce' ('+' | '*'))?
+///                'in' expression
+/// Unlike a 'for', the end is the bound itself: the variable runs from the
+/// start up to, but not including, the end, in steps of 1.
+static ExprAST *ParseParForExpr() {
+  getNextToken(); // eat the parfor.
+
+  if (CurTok != tok_identifier)
+    return LogError("expected identifier after parfor");
+
+  SymbolID IdName = IdentifierID;
+  getNextToken(); // eat identifier.
+
+  if (CurTok != '=')
+    return LogError("expected '=' after parfor");
+  getNextToken(); // eat '='.
+
+  auto Start = ParseExpression();
+  if (!Start)
+    return nullptr;
+  if (CurTok != ',')
+    return LogError("expected ',' after parfor start value");
+  getNextToken();
+
+  auto End = ParseExpression();
+  if (!End)
+    return nullptr;
+
+  // 'reduce' is only special here, like the loop hints.
+  char Reduce = 0;
+  if (CurTok == tok_identifier && IdentifierID == ReduceID) {
+    getNextToken(); // eat 'reduce'.
+    if (CurTok != '+' && CurTok != '*')
+      return LogError("expected '+' or '*' after reduce");
+    Reduce = (char)CurTok;
+    getNextToken();
+  }
+
+  if (CurTok != tok_in)
+    return LogError("expected 'in' after parfor");
+  getNextToken(); // eat 'in'.
+
+  auto Body = ParseExpression();
+  if (!Body)
+    return nullptr;
+
+  ItemHasLoop = true;
+  return newNode<ParForExprAST>(IdName, Start, End, Body, Reduce);
 }
 
 /// varexpr ::= 'var' identifier ('=' expression)?
 //                    (',' identifier ('=' expression)?)* 'in' expression
-static std::unique_ptr<ExprAST> ParseVarExpr() {
+static ExprAST *ParseVarExpr() {
   getNextToken(); // eat the var.
 
-  std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+  SmallVector<VarBinding, 4> VarNames;
 
   // At least one variable name is required.
   if (CurTok != tok_identifier)
     return LogError("expected identifier after var");
 
   while (true) {
-    std::string Name = IdentifierStr;
+    SymbolID Name = IdentifierID;
     getNextToken(); // eat identifier.
 
     // Read the optional initializer.
-    std::unique_ptr<ExprAST> Init = nullptr;
+    ExprAST *Init = nullptr;
     if (CurTok == '=') {
       getNextToken(); // eat the '='.
 
@@ -487,7 +1451,7 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
         return nullptr;
     }
 
-    VarNames.push_back(std::make_pair(Name, std::move(Init)));
+    VarNames.push_back(std::make_pair(Name, Init));
 
     // End of var list, exit loop.
     if (CurTok != ',')
@@ -507,7 +1471,7 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
   if (!Body)
     return nullptr;
 
-  return llvm::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+  return newNode<VarExprAST>(copyToArena<VarBinding>(VarNames), Body);
 }
 
 /// primary
@@ -516,8 +1480,9 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
 ///   ::= parenexpr
 ///   ::= ifexpr
 ///   ::= forexpr
+///   ::= parforexpr
 ///   ::= varexpr
-static std::unique_ptr<ExprAST> ParsePrimary() {
+static ExprAST *ParsePrimary() {
   switch (CurTok) {
   default:
     return LogError("unknown token when expecting an expression");
@@ -531,31 +1496,50 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
     return ParseIfExpr();
   case tok_for:
     return ParseForExpr();
+  case tok_parfor:
+    return ParseParForExpr();
   case tok_var:
     return ParseVarExpr();
   }
 }
 
+/// postfix
+///   ::= primary ('[' expression ']')*
+static ExprAST *ParsePostfix() {
+  auto E = ParsePrimary();
+  while (E && CurTok == '[') {
+    getNextToken(); // eat [.
+    auto Index = ParseExpression();
+    if (!Index)
+      return nullptr;
+    if (CurTok != ']')
+      return LogError("expected ']'");
+    getNextToken(); // eat ].
+    ItemUsesTypedValues = true;
+    E = newNode<IndexExprAST>(E, Index);
+  }
+  return E;
+}
+
 /// unary
-///   ::= primary
+///   ::= postfix
 ///   ::= '!' unary
-static std::unique_ptr<ExprAST> ParseUnary() {
+static ExprAST *ParseUnary() {
   // If the current token is not an operator, it must be a primary expr.
   if (!isascii(CurTok) || CurTok == '(' || CurTok == ',')
-    return ParsePrimary();
+    return ParsePostfix();
 
   // If this is a unary operator, read it.
   int Opc = CurTok;
   getNextToken();
   if (auto Operand = ParseUnary())
-    return llvm::make_unique<UnaryExprAST>(Opc, std::move(Operand));
+    return newNode<UnaryExprAST>(Opc, Operand);
   return nullptr;
 }
 
 /// binoprhs
 ///   ::= ('+' unary)*
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                              std::unique_ptr<ExprAST> LHS) {
+static ExprAST *ParseBinOpRHS(int ExprPrec, ExprAST *LHS) {
   // If this is a binop, find its precedence.
   while (true) {
     int TokPrec = GetTokPrecedence();
@@ -578,43 +1562,78 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
     // the pending operator take RHS as its LHS.
     int NextPrec = GetTokPrecedence();
     if (TokPrec < NextPrec) {
-      RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
+      RHS = ParseBinOpRHS(TokPrec + 1, RHS);
       if (!RHS)
         return nullptr;
     }
 
     // Merge LHS/RHS.
-    LHS =
-        llvm::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+    LHS = newNode<BinaryExprAST>(BinOp, LHS, RHS);
   }
 }
 
 /// expression
 ///   ::= unary binoprhs
 ///
-static std::unique_ptr<ExprAST> ParseExpression() {
+static ExprAST *ParseExpression() {
   auto LHS = ParseUnary();
   if (!LHS)
     return nullptr;
 
-  return ParseBinOpRHS(0, std::move(LHS));
+  return ParseBinOpRHS(0, LHS);
+}
+
+/// type ::= ':' ('double' | 'int' | 'vec4' | 'array')
+static bool ParseType(TypeKind &Ty) {
+  getNextToken(); // eat ':'.
+  if (CurTok == tok_identifier && IdentifierID == DoubleTypeID)
+    Ty = TK_Double;
+  else if (CurTok == tok_identifier && IdentifierID == IntTypeID)
+    Ty = TK_Int;
+  else if (CurTok == tok_identifier && IdentifierID == Vec4TypeID)
+    Ty = TK_Vec4;
+  else if (CurTok == tok_identifier && IdentifierID == ArrayTypeID)
+    Ty = TK_Array;
+  else {
+    LogError("Expected 'double', 'int', 'vec4' or 'array' after ':'");
+    return false;
+  }
+  getNextToken(); // eat the type name.
+  return true;
 }
 
 /// prototype
-///   ::= id '(' id* ')'
-///   ::= binary LETTER number? (id, id)
-///   ::= unary LETTER (id)
+///   ::= qualifier* id '(' (id type?)* ')' type?
+///   ::= qualifier* binary LETTER number? (id type?, id type?) type?
+///   ::= qualifier* unary LETTER (id type?) type?
+/// qualifier ::= 'memo' | 'fastmath'
 static std::unique_ptr<PrototypeAST> ParsePrototype() {
-  std::string FnName;
+  SymbolID FnName;
 
   unsigned Kind = 0; // 0 = identifier, 1 = unary, 2 = binary.
   unsigned BinaryPrecedence = 30;
 
+  // A qualifier followed by '(' is the name of the function, so they stay
+  // usable as names.
+  bool IsMemo = false, IsFastMath = false, NamedByQualifier = false;
+  while (CurTok == tok_identifier &&
+         (IdentifierID == MemoID || IdentifierID == FastMathID)) {
+    FnName = IdentifierID;
+    getNextToken(); // eat the qualifier.
+    if (CurTok == '(') {
+      NamedByQualifier = true;
+      break;
+    }
+    (FnName == MemoID ? IsMemo : IsFastMath) = true;
+  }
+
   switch (CurTok) {
   default:
+    if (NamedByQualifier)
+      break;
     return LogErrorP("Expected function name in prototype");
   case tok_identifier:
-    FnName = IdentifierStr;
+    FnName = IdentifierID;
     Kind = 0;
     getNextToken();
     break;
@@ -622,8 +1641,7 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     getNextToken();
     if (!isascii(CurTok))
       return LogErrorP("Expected unary operator");
-    FnName = "unary";
-    FnName += (char)CurTok;
+    FnName = getOperatorID(false, CurTok);
     Kind = 1;
     getNextToken();
     break;
@@ -631,8 +1649,7 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     getNextToken();
     if (!isascii(CurTok))
       return LogErrorP("Expected binary operator");
-    FnName = "binary";
-    FnName += (char)CurTok;
+    FnName = getOperatorID(true, CurTok);
     Kind = 2;
     getNextToken();
 
@@ -649,80 +1666,502 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
   if (CurTok != '(')
     return LogErrorP("Expected '(' in prototype");
 
-  std::vector<std::string> ArgNames;
-  while (getNextToken() == tok_identifier)
-    ArgNames.push_back(IdentifierStr);
+  std::vector<SymbolID> ArgNames;
+  std::vector<TypeKind> ArgTypes;
+  getNextToken(); // eat '('.
+  while (CurTok == tok_identifier) {
+    ArgNames.push_back(IdentifierID);
+    getNextToken();
+    TypeKind Ty = TK_Double;
+    if (CurTok == ':' && !ParseType(Ty))
+      return nullptr;
+    ArgTypes.push_back(Ty);
+  }
   if (CurTok != ')')
     return LogErrorP("Expected ')' in prototype");
 
   // success.
   getNextToken(); // eat ')'.
 
+  TypeKind ReturnType = TK_Double;
+  if (CurTok == ':' && !ParseType(ReturnType))
+    return nullptr;
+
   // Verify right number of names for operator.
   if (Kind && ArgNames.size() != Kind)
     return LogErrorP("Invalid number of operands for operator");
 
-  return llvm::make_unique<PrototypeAST>(FnName, ArgNames, Kind != 0,
-                                         BinaryPrecedence);
+  auto Proto = llvm::make_unique<PrototypeAST>(
+      FnName, ArgNames, Kind != 0, BinaryPrecedence, std::move(ArgTypes),
+      ReturnType);
+  if (IsMemo) {
+    // Results are remembered by the bits of the arguments.
+    if (Proto->hasTypedValues())
+      return LogErrorP("A memo function takes and returns only doubles");
+    Proto->setMemo();
+  }
+  if (IsFastMath)
+    Proto->setFastMath();
+  return Proto;
 }
 
-/// definition ::= 'def' prototype expression
-static std::unique_ptr<FunctionAST> ParseDefinition() {
-  getNextToken(); // eat def.
-  auto Proto = ParsePrototype();
-  if (!Proto)
-    return nullptr;
+//===----------------------------------------------------------------------===//
+// AST simplification
+//===----------------------------------------------------------------------===//
 
-  if (auto Body = ParseExpression())
-    return llvm::make_unique<FunctionAST>(std::move(Proto), std::move(Body));
-  return nullptr;
+/// countNodes - The number of nodes in the tree rooted at E.
+static uint64_t countNodes(ExprAST *E) {
+  uint64_t N = 1;
+  E->forEachChild([&](ExprAST *&Child) { N += countNodes(Child); });
+  return N;
 }
 
-/// toplevelexpr ::= expression
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
-  if (auto E = ParseExpression()) {
-    // Make an anonymous proto.
-    auto Proto = llvm::make_unique<PrototypeAST>("__anon_expr",
-                                                 std::vector<std::string>());
-    return llvm::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-  }
-  return nullptr;
+/// simplifyExpr - Simplify E bottom-up, so that each node folds with its
+/// operands simplified already.
+static ExprAST *simplifyExpr(ExprAST *E) {
+  E->forEachChild([](ExprAST *&Child) { Child = simplifyExpr(Child); });
+  return E->fold();
 }
 
-/// external ::= 'extern' prototype
-static std::unique_ptr<PrototypeAST> ParseExtern() {
-  getNextToken(); // eat extern.
-  return ParsePrototype();
-}
+/// Only rewrites that hold for every double are made: 'x+0' is not 'x' for
+/// x = -0.0, and 'x*0' is not 0 for infinities and NaNs.
+ExprAST *BinaryExprAST::fold() {
+  double L, R;
+  bool LConst = LHS->getLiteral(L), RConst = RHS->getLiteral(R);
+  if (LConst && RConst) {
+    switch (Op) {
+    case '+':
+      return newNode<NumberExprAST>(L + R);
+    case '-':
+      return newNode<NumberExprAST>(L - R);
+    case '*':
+      return newNode<NumberExprAST>(L * R);
+    case '<':
+      // Unordered, like codegen's 'fcmp ult': a NaN operand gives 1.0.
+      return newNode<NumberExprAST>(!(L >= R) ? 1.0 : 0.0);
+    default:
+      return this;
+    }
+  }
+
+  switch (Op) {
+  case '-': // x - 0.0 == x, but x - -0.0 is x + 0.0.
+    if (RConst && R == 0.0 && !std::signbit(R))
+      return LHS;
+    break;
+  case '*':
+    if (RConst && R == 1.0)
+      return LHS;
+    if (LConst && L == 1.0)
+      return RHS;
+    break;
+  }
+  return this;
+}
+
+ExprAST *IfExprAST::fold() {
+  double C;
+  if (!Cond->getLiteral(C))
+    return this;
+  // The condition is tested the way 'fcmp one C, 0.0' does.
+  return C < 0.0 || C > 0.0 ? Then : Else;
+}
+
+/// simplifyItem - Simplify the body of the item just parsed, in its arena.
+/// Typed items are left alone: folding could change which type an operator
+/// sees.
+static ExprAST *simplifyItem(ExprAST *Body, const PrototypeAST &Proto) {
+  if (!SimplifyAST || ItemUsesTypedValues || Proto.hasTypedValues())
+    return Body;
+  uint64_t Before = countNodes(Body);
+  Body = simplifyExpr(Body);
+  NumSimplifiedNodes += Before - countNodes(Body);
+  return Body;
+}
+
+/// definition ::= 'def' prototype expression
+static std::unique_ptr<FunctionAST> ParseDefinition() {
+  PhaseTimer Timer(PhaseParse);
+  getNextToken(); // eat def.
+  auto Proto = ParsePrototype();
+  if (!Proto)
+    return nullptr;
+
+  BeginItemArena();
+  if (auto Body = ParseExpression()) {
+    Body = simplifyItem(Body, *Proto);
+    return llvm::make_unique<FunctionAST>(std::move(Proto), Body,
+                                          std::move(ParseArena), ItemHasLoop,
+                                          ItemUsesTypedValues);
+  }
+  return nullptr;
+}
+
+/// toplevelexpr ::= expression
+static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
+  PhaseTimer Timer(PhaseParse);
+  BeginItemArena();
+  if (auto E = ParseExpression()) {
+    // Make an anonymous proto.
+    auto Proto = llvm::make_unique<PrototypeAST>(AnonExprID,
+                                                 std::vector<SymbolID>());
+    E = simplifyItem(E, *Proto);
+    return llvm::make_unique<FunctionAST>(std::move(Proto), E,
+                                          std::move(ParseArena), ItemHasLoop,
+                                          ItemUsesTypedValues);
+  }
+  return nullptr;
+}
+
+/// external ::= 'extern' prototype
+static std::unique_ptr<PrototypeAST> ParseExtern() {
+  PhaseTimer Timer(PhaseParse);
+  getNextToken(); // eat extern.
+  auto Proto = ParsePrototype();
+  if (Proto && (Proto->isMemo() || Proto->isFastMath()))
+    return LogErrorP("Only a definition can be memo or fastmath");
+  return Proto;
+}
+
+//===----------------------------------------------------------------------===//
+// Memo tables
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+/// MemoTable - The results a memo function has returned, keyed on the bits of
+/// its arguments.  It holds a fixed number of entries in sets of MemoWays;
+/// when a result's set is full, the entry used longest ago makes room.  Both
+/// compiled code and the interpreter use it, possibly from several parfor
+/// threads at once.
+class MemoTable {
+  static const unsigned MemoWays = 4;
+
+  std::string Name;
+  unsigned NumArgs;
+  uint64_t SetMask;
+  std::vector<uint64_t> Keys; // NumArgs per entry.
+  std::vector<double> Results;
+  std::vector<uint64_t> LastUse; // Zero for an empty entry.
+  uint64_t Clock = 0;
+  std::mutex Mutex;
+
+  uint64_t *getKey(uint64_t Entry) { return Keys.data() + Entry * NumArgs; }
+
+  /// getSet - The first entry of the set Args belong in, and Args' bits.
+  uint64_t getSet(const double *Args, uint64_t *Bits) const {
+    // Small integers differ only in their high bits, so each word is mixed
+    // all the way down.
+    uint64_t Hash = NumArgs;
+    for (unsigned i = 0; i != NumArgs; ++i) {
+      memcpy(&Bits[i], &Args[i], sizeof(double));
+      Hash ^= Bits[i];
+      Hash ^= Hash >> 33;
+      Hash *= 0xff51afd7ed558ccdULL;
+      Hash ^= Hash >> 33;
+      Hash *= 0xc4ceb9fe1a85ec53ULL;
+      Hash ^= Hash >> 33;
+    }
+    return (Hash & SetMask) * MemoWays;
+  }
+
+public:
+  uint64_t Calls = 0, Hits = 0, Evictions = 0;
+
+  MemoTable(StringRef Name, unsigned NumArgs, unsigned Size)
+      : Name(Name), NumArgs(NumArgs) {
+    uint64_t Sets = PowerOf2Ceil(std::max(Size / MemoWays, 1u));
+    SetMask = Sets - 1;
+    Keys.resize(Sets * MemoWays * NumArgs);
+    Results.resize(Sets * MemoWays);
+    LastUse.resize(Sets * MemoWays);
+  }
+
+  StringRef getName() const { return Name; }
+
+  /// find - Set Result to the remembered result for Args, if there is one.
+  bool find(const double *Args, double &Result) {
+    SmallVector<uint64_t, 8> Bits(NumArgs);
+    uint64_t Set = getSet(Args, Bits.data());
+    std::lock_guard<std::mutex> Lock(Mutex);
+    ++Calls;
+    for (uint64_t E = Set; E != Set + MemoWays; ++E)
+      if (LastUse[E] &&
+          memcmp(getKey(E), Bits.data(), NumArgs * sizeof(uint64_t)) == 0) {
+        LastUse[E] = ++Clock;
+        Result = Results[E];
+        ++Hits;
+        return true;
+      }
+    return false;
+  }
+
+  /// insert - Remember Result for Args.
+  void insert(const double *Args, double Result) {
+    SmallVector<uint64_t, 8> Bits(NumArgs);
+    uint64_t Set = getSet(Args, Bits.data());
+    std::lock_guard<std::mutex> Lock(Mutex);
+    uint64_t Victim = Set;
+    for (uint64_t E = Set; E != Set + MemoWays; ++E) {
+      // Another thread may have got here first.
+      if (LastUse[E] &&
+          memcmp(getKey(E), Bits.data(), NumArgs * sizeof(uint64_t)) == 0) {
+        Victim = E;
+        break;
+      }
+      if (LastUse[E] < LastUse[Victim])
+        Victim = E;
+    }
+    if (LastUse[Victim] &&
+        memcmp(getKey(Victim), Bits.data(), NumArgs * sizeof(uint64_t)) != 0)
+      ++Evictions;
+    memcpy(getKey(Victim), Bits.data(), NumArgs * sizeof(uint64_t));
+    Results[Victim] = Result;
+    LastUse[Victim] = ++Clock;
+  }
+};
+
+} // end anonymous namespace
+
+/// Every memo table made so far.  Compiled code points straight at its
+/// function's table, so tables stay until the program exits.
+static std::vector<std::unique_ptr<MemoTable>> MemoTables;
+
+MemoTable &FunctionAST::getMemoTable() {
+  if (!Memo) {
+    MemoTables.push_back(llvm::make_unique<MemoTable>(
+        Symbols.getName(Proto->getName()), Proto->getArgs().size(), MemoSize));
+    Memo = MemoTables.back().get();
+  }
+  return *Memo;
+}
+
+/// PrintMemoReport - Print each table's hit rate.
+static void PrintMemoReport() {
+  for (auto &T : MemoTables)
+    fprintf(stderr,
+            "memo: %s: %llu calls, %llu hits (%.1f%%), %llu evictions\n",
+            T->getName().str().c_str(), (unsigned long long)T->Calls,
+            (unsigned long long)T->Hits,
+            T->Calls ? 100.0 * T->Hits / T->Calls : 0.0,
+            (unsigned long long)T->Evictions);
+}
 
 //===----------------------------------------------------------------------===//
 // Code Generation
 //===----------------------------------------------------------------------===//
 
-static LLVMContext TheContext;
-static IRBuilder<> Builder(TheContext);
+static std::unique_ptr<LLVMContext> TheContext;
+static std::unique_ptr<IRBuilder<>> Builder;
 static std::unique_ptr<Module> TheModule;
-static std::map<std::string, AllocaInst *> NamedValues;
+static DenseMap<SymbolID, AllocaInst *> NamedValues;
 static std::unique_ptr<legacy::FunctionPassManager> TheFPM;
 static std::unique_ptr<KaleidoscopeJIT> TheJIT;
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+static DenseMap<SymbolID, std::unique_ptr<PrototypeAST>> FunctionProtos;
+
+/// The parfor bodies, and the memo function body, outlined while generating
+/// the current definition.  They are optimized, or dropped, along with it.
+/// A copy made by codegenInlinable keeps its own apart.
+static SmallVector<Function *, 4> OutlinedBodies;
+
+/// Definitions parsed in -lazy mode that have not been compiled yet, and the
+/// ones among them that compiled code has started referring to.
+static DenseMap<SymbolID, std::unique_ptr<FunctionAST>> LazyDefinitions;
+static std::vector<SymbolID> PendingDefinitions;
+
+/// Definitions -tiered mode has since compiled.
+static std::vector<std::unique_ptr<FunctionAST>> PromotedDefinitions;
+
+/// Compiled operator definitions.  Their ASTs are kept so that every module
+/// using an operator can carry a copy of its body for the inliner.
+static DenseMap<SymbolID, std::unique_ptr<FunctionAST>> InlinableDefinitions;
+
+/// isInlinable - Whether modules calling FnAST get a copy of its body.
+static bool isInlinable(FunctionAST &FnAST) {
+  PrototypeAST &P = FnAST.getProto();
+  return P.isUnaryOp() || P.isBinaryOp();
+}
+
+/// Copies of operators, and with -whole-program definitions, with at most
+/// this many instructions, as generated, are always inlined.  That covers
+/// operators and one-line helpers.
+static const unsigned SmallDefinitionSize = 40;
 
 Value *LogErrorV(const char *Str) {
   LogError(Str);
   return nullptr;
 }
 
-Function *getFunction(std::string Name) {
+/// hasTypedSignature - Whether the function Name, if it is known yet, takes
+/// or returns anything but doubles.
+static bool hasTypedSignature(SymbolID Name) {
+  auto FI = FunctionProtos.find(Name);
+  if (FI != FunctionProtos.end())
+    return FI->second->hasTypedValues();
+  auto LI = LazyDefinitions.find(Name);
+  return LI != LazyDefinitions.end() &&
+         LI->second->getProto().hasTypedValues();
+}
+
+/// getArrayType - The runtime's KArray header: the elements and their count.
+static StructType *getArrayType() {
+  return StructType::get(*TheContext, {Type::getDoublePtrTy(*TheContext),
+                                       Type::getInt64Ty(*TheContext)});
+}
+
+static Type *getType(TypeKind Ty) {
+  Type *DoubleTy = Type::getDoubleTy(*TheContext);
+  switch (Ty) {
+  case TK_Double:
+    return DoubleTy;
+  case TK_Int:
+    return Type::getInt64Ty(*TheContext);
+  case TK_Vec4:
+    return VectorType::get(DoubleTy, 4);
+  case TK_Array:
+    return getArrayType()->getPointerTo();
+  }
+  llvm_unreachable("unknown TypeKind");
+}
+
+static bool isArray(Value *V) { return V->getType()->isPointerTy(); }
+
+/// getRuntimeFunction - Declare the runtime support function Name in the
+/// current module.
+static Function *getRuntimeFunction(StringRef Name, Type *Result,
+                                    ArrayRef<Type *> Params) {
+  if (Function *F = TheModule->getFunction(Name))
+    return F;
+  return Function::Create(FunctionType::get(Result, Params, false),
+                          Function::ExternalLinkage, Name, TheModule.get());
+}
+
+/// The attributes that have the code generator treat a function's floating
+/// point as fast math too, the same ones clang's -ffast-math sets.
+static const char *const FastMathAttributes[] = {
+    "unsafe-fp-math", "no-infs-fp-math", "no-nans-fp-math",
+    "no-signed-zeros-fp-math"};
+
+/// setFastMath - Set F's fast-math attributes to "true" or "false".  Every
+/// function gets them, as clang does: the code generator copies only the
+/// attributes a function has into its TargetMachine's options, and the JIT
+/// reuses TargetMachines, so a strict function without them would be
+/// compiled with the options of a fastmath one before it.
+static void setFastMath(Function *F, bool Fast) {
+  for (const char *Attr : FastMathAttributes)
+    F->addFnAttr(Attr, Fast ? "true" : "false");
+}
+
+static bool isFastMath(const Function *F) {
+  return F->getFnAttribute(FastMathAttributes[0]).getValueAsString() ==
+         "true";
+}
+
+static const char *describeType(Type *Ty) {
+  if (Ty->isIntegerTy())
+    return "an int";
+  if (Ty->isVectorTy())
+    return "a vec4";
+  if (Ty->isPointerTy())
+    return "an array";
+  return "a double";
+}
+
+/// getIntegralConstant - If V is a double constant with an integer value, i.e.
+/// what a literal like "1" becomes, the same value as an int.
+static Constant *getIntegralConstant(Value *V) {
+  auto *C = dyn_cast<ConstantFP>(V);
+  if (!C)
+    return nullptr;
+  double D = C->getValueAPF().convertToDouble();
+  if (!(D >= -9.2e18 && D <= 9.2e18) || D != (double)(int64_t)D)
+    return nullptr;
+  return Builder->getInt64((int64_t)D);
+}
+
+/// convertTo - Convert V for a place that holds a Ty, or report that What
+/// must be one.  An int widens to a double implicitly; a double only becomes
+/// an int if it is an integral constant, otherwise that takes int(x).
+static Value *convertTo(Value *V, Type *Ty, const char *What) {
+  if (!V || V->getType() == Ty)
+    return V;
+  if (V->getType()->isIntegerTy() && Ty->isDoubleTy())
+    return Builder->CreateSIToFP(V, Ty, "conv");
+  if (Ty->isIntegerTy())
+    if (Constant *C = getIntegralConstant(V))
+      return C;
+  fprintf(stderr, "Error: %s must be %s, not %s\n", What, describeType(Ty),
+          describeType(V->getType()));
+  return nullptr;
+}
+
+static Value *toDouble(Value *V, const char *What) {
+  return convertTo(V, Builder->getDoubleTy(), What);
+}
+
+/// toIndex - V as an int for counting or indexing: ints as they are, doubles
+/// rounded toward zero.
+static Value *toIndex(Value *V, const char *What) {
+  if (!V || V->getType()->isIntegerTy())
+    return V;
+  V = toDouble(V, What);
+  return V ? Builder->CreateFPToSI(V, Builder->getInt64Ty(), "idx") : nullptr;
+}
+
+/// toCondition - An i1 that is true where V is non-zero.
+static Value *toCondition(Value *V, const char *What, const Twine &Name) {
+  if (!V)
+    return nullptr;
+  if (V->getType()->isIntegerTy())
+    return Builder->CreateICmpNE(V, Builder->getInt64(0), Name);
+  if (!toDouble(V, What))
+    return nullptr;
+  return Builder->CreateFCmpONE(
+      V, ConstantFP::get(*TheContext, APFloat(0.0)), Name);
+}
+
+/// createCall - Call F with Args, converted to its parameter types.
+static Value *createCall(Function *F, ArrayRef<Value *> Args,
+                         const Twine &Name) {
+  if (F->arg_size() != Args.size())
+    return LogErrorV("Incorrect # arguments passed");
+  SmallVector<Value *, 8> ArgsV;
+  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+    ArgsV.push_back(convertTo(
+        Args[i], F->getFunctionType()->getParamType(i), "An argument"));
+    if (!ArgsV.back())
+      return nullptr;
+  }
+  return Builder->CreateCall(F, ArgsV, Name);
+}
+
+Function *getFunction(SymbolID Name) {
   // First, see if the function has already been added to the current module.
-  if (auto *F = TheModule->getFunction(Name))
+  if (auto *F = TheModule->getFunction(Symbols.getName(Name)))
     return F;
 
+  // An operator compiled into another module: emit a copy of its body here,
+  // so that calls to it can be inlined.
+  auto II = InlinableDefinitions.find(Name);
+  if (II != InlinableDefinitions.end())
+    return II->second->codegenInlinable();
+
   // If not, check whether we can codegen the declaration from some existing
   // prototype.
   auto FI = FunctionProtos.find(Name);
   if (FI != FunctionProtos.end())
     return FI->second->codegen();
 
+  // A deferred definition: declare it here and queue its body to be compiled
+  // before this module runs.
+  auto LI = LazyDefinitions.find(Name);
+  if (LI != LazyDefinitions.end()) {
+    PendingDefinitions.push_back(Name);
+    if (isInlinable(*LI->second))
+      return LI->second->codegenInlinable();
+    return LI->second->getProto().codegen();
+  }
+
   // If no existing prototype exists, return null.
   return nullptr;
 }
@@ -730,24 +2169,197 @@ Function *getFunction(std::string Name) {
 /// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
 /// the function.  This is used for mutable variables etc.
 static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
-                                          const std::string &VarName) {
+                                          StringRef VarName, Type *Ty) {
   IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
                    TheFunction->getEntryBlock().begin());
-  return TmpB.CreateAlloca(Type::getDoubleTy(TheContext), nullptr, VarName);
+  return TmpB.CreateAlloca(Ty, nullptr, VarName);
 }
 
 Value *NumberExprAST::codegen() {
-  return ConstantFP::get(TheContext, APFloat(Val));
+  return ConstantFP::get(*TheContext, APFloat(Val));
 }
 
 Value *VariableExprAST::codegen() {
   // Look this variable up in the function.
-  Value *V = NamedValues[Name];
+  Value *V = NamedValues.lookup(Name);
   if (!V)
     return LogErrorV("Unknown variable name");
 
   // Load the value.
-  return Builder.CreateLoad(V, Name.c_str());
+  return Builder->CreateLoad(V, Symbols.getName(Name));
+}
+
+Value *ExprAST::codegenAssign(Value *Val) {
+  return LogErrorV("destination of '=' must be a variable");
+}
+
+/// createReturn - Return V from the function being generated, converted to
+/// its return type.
+static bool createReturn(Value *V) {
+  Function *F = Builder->GetInsertBlock()->getParent();
+  V = convertTo(V, F->getReturnType(),
+                F->getName() == Symbols.getName(AnonExprID)
+                    ? "A top-level expression"
+                    : "The function body");
+  if (!V)
+    return false;
+  Builder->CreateRet(V);
+  return true;
+}
+
+bool ExprAST::codegenReturn() { return createReturn(codegen()); }
+
+Value *VariableExprAST::codegenAssign(Value *Val) {
+  // Look up the name.
+  AllocaInst *Variable = NamedValues.lookup(Name);
+  if (!Variable)
+    return LogErrorV("Unknown variable name");
+  Val = convertTo(Val, Variable->getAllocatedType(), "The assigned value");
+  if (!Val)
+    return nullptr;
+
+  Builder->CreateStore(Val, Variable);
+  return Val;
+}
+
+Value *VectorExprAST::codegen() {
+  SmallVector<Value *, 4> Lanes;
+  for (ExprAST *Elt : Elts) {
+    Lanes.push_back(toDouble(Elt->codegen(), "A vec4 lane"));
+    if (!Lanes.back())
+      return nullptr;
+  }
+
+  if (Lanes.size() == 1)
+    return Builder->CreateVectorSplat(4, Lanes[0], "vec");
+  Value *V = UndefValue::get(getType(TK_Vec4));
+  for (unsigned i = 0; i != 4; ++i)
+    V = Builder->CreateInsertElement(V, Lanes[i], Builder->getInt32(i), "vec");
+  return V;
+}
+
+Value *IntExprAST::codegen() {
+  return toIndex(Operand->codegen(), "The value of int(x)");
+}
+
+Value *ArrayExprAST::codegen() {
+  Value *LengthV = toIndex(Length->codegen(), "An array length");
+  if (!LengthV)
+    return nullptr;
+  Function *F = getRuntimeFunction("kaleidoscope_array_new",
+                                   getType(TK_Array), Builder->getInt64Ty());
+  return Builder->CreateCall(F, LengthV, "array");
+}
+
+/// loadArrayField - Load field Field of the header of ArrayV.  A header never
+/// changes once its array exists, so the loads are marked invariant; that
+/// lets LICM hoist them out of a loop even when the loop stores to elements.
+static Value *loadArrayField(Value *ArrayV, unsigned Field,
+                             const Twine &Name) {
+  Value *Ptr = Builder->CreateStructGEP(getArrayType(), ArrayV, Field);
+  LoadInst *L = Builder->CreateLoad(Ptr, Name);
+  L->setMetadata(LLVMContext::MD_invariant_load,
+                 MDNode::get(*TheContext, None));
+  return L;
+}
+
+Value *LengthExprAST::codegen() {
+  Value *ArrayV = Array->codegen();
+  if (!ArrayV)
+    return nullptr;
+  if (!isArray(ArrayV))
+    return LogErrorV("len takes an array");
+  return loadArrayField(ArrayV, 1, "len");
+}
+
+/// codegenElementPtr - Emit the address of element Index of ArrayV, after
+/// checking that it is in bounds.  The check is a single unsigned compare
+/// against the length, whose failure path is cold and never returns: the
+/// shape of range check that IRCE splits out of loops, and that SCEV drops
+/// when the loop bounds already imply it.
+static Value *codegenElementPtr(Value *ArrayV, ExprAST *Index) {
+  Value *IndexV = toIndex(Index->codegen(), "An array index");
+  if (!IndexV)
+    return nullptr;
+  Type *Int64Ty = Builder->getInt64Ty();
+  Value *Data = loadArrayField(ArrayV, 0, "data");
+  Value *Length = loadArrayField(ArrayV, 1, "len");
+
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  BasicBlock *InBB = BasicBlock::Create(*TheContext, "inbounds", TheFunction);
+  BasicBlock *OutBB = BasicBlock::Create(*TheContext, "outofbounds", TheFunction);
+  Value *InBounds = Builder->CreateICmpULT(IndexV, Length, "inbounds");
+  Builder->CreateCondBr(InBounds, InBB, OutBB,
+                        MDBuilder(*TheContext).createBranchWeights(1 << 20, 1));
+
+  Builder->SetInsertPoint(OutBB);
+  Type *Params[] = {Int64Ty, Int64Ty};
+  Function *Fail = getRuntimeFunction("kaleidoscope_array_bounds",
+                                      Builder->getVoidTy(), Params);
+  Fail->setDoesNotReturn();
+  Fail->addFnAttr(Attribute::Cold);
+  Value *Args[] = {IndexV, Length};
+  Builder->CreateCall(Fail, Args)->setDoesNotReturn();
+  Builder->CreateUnreachable();
+
+  Builder->SetInsertPoint(InBB);
+  return Builder->CreateGEP(Data, IndexV, "eltptr");
+}
+
+/// codegenLane - Emit the index of a lane of VecV.  Double indices are
+/// rounded toward zero; constant ones are checked here, anything else must be
+/// in 0..3.
+static Value *codegenLane(Value *VecV, ExprAST *Index) {
+  if (!VecV->getType()->isVectorTy())
+    return LogErrorV("Only a vec4 or an array can be indexed");
+  Value *IndexV = toIndex(Index->codegen(), "A lane index");
+  if (!IndexV)
+    return nullptr;
+  if (auto *C = dyn_cast<ConstantInt>(IndexV))
+    if (C->getValue().uge(4))
+      return LogErrorV("vec4 lane index out of range");
+  return Builder->CreateTrunc(IndexV, Builder->getInt32Ty(), "lane");
+}
+
+Value *IndexExprAST::codegen() {
+  Value *VecV = Vec->codegen();
+  if (!VecV)
+    return nullptr;
+
+  if (isArray(VecV)) {
+    Value *Ptr = codegenElementPtr(VecV, Index);
+    return Ptr ? Builder->CreateLoad(Ptr, "elt") : nullptr;
+  }
+
+  Value *Lane = codegenLane(VecV, Index);
+  return Lane ? Builder->CreateExtractElement(VecV, Lane, "elt") : nullptr;
+}
+
+Value *IndexExprAST::codegenAssign(Value *Val) {
+  Val = toDouble(Val, "A value stored in a vec4 or array");
+  if (!Val)
+    return nullptr;
+  Value *VecV = Vec->codegen();
+  if (!VecV)
+    return nullptr;
+
+  // Arrays are references: store straight into the element.
+  if (isArray(VecV)) {
+    Value *Ptr = codegenElementPtr(VecV, Index);
+    if (!Ptr)
+      return nullptr;
+    Builder->CreateStore(Val, Ptr);
+    return Val;
+  }
+
+  // A vec4 is a value: build the updated vector and assign it back.
+  Value *Lane = codegenLane(VecV, Index);
+  if (!Lane)
+    return nullptr;
+  VecV = Builder->CreateInsertElement(VecV, Val, Lane, "vec");
+  if (!Vec->codegenAssign(VecV))
+    return nullptr;
+  return Val;
 }
 
 Value *UnaryExprAST::codegen() {
@@ -755,35 +2367,55 @@ Value *UnaryExprAST::codegen() {
   if (!OperandV)
     return nullptr;
 
-  Function *F = getFunction(std::string("unary") + Opcode);
+  Function *F = getFunction(getOperatorID(false, Opcode));
   if (!F)
     return LogErrorV("Unknown unary operator");
 
-  return Builder.CreateCall(F, OperandV, "unop");
+  return createCall(F, OperandV, "unop");
+}
+
+/// unifyOperands - Bring the operands of a builtin operator to one type.  An
+/// integral literal next to an int is an int; otherwise an int meets a double
+/// or a vec4 as a double, and a double meets a vec4 in every lane.
+static bool unifyOperands(Value *&L, Value *&R) {
+  if (isArray(L) || isArray(R)) {
+    LogError("Arrays have no arithmetic operators");
+    return false;
+  }
+  if (L->getType() == R->getType())
+    return true;
+
+  Constant *C;
+  if (L->getType()->isIntegerTy() && (C = getIntegralConstant(R))) {
+    R = C;
+    return true;
+  }
+  if (R->getType()->isIntegerTy() && (C = getIntegralConstant(L))) {
+    L = C;
+    return true;
+  }
+
+  if (L->getType()->isIntegerTy())
+    L = toDouble(L, "An operand");
+  if (R->getType()->isIntegerTy())
+    R = toDouble(R, "An operand");
+  if (L->getType()->isVectorTy() && !R->getType()->isVectorTy())
+    R = Builder->CreateVectorSplat(4, R, "splat");
+  else if (R->getType()->isVectorTy() && !L->getType()->isVectorTy())
+    L = Builder->CreateVectorSplat(4, L, "splat");
+  return true;
 }
 
 Value *BinaryExprAST::codegen() {
   // Special case '=' because we don't want to emit the LHS as an expression.
   if (Op == '=') {
-    // Assignment requires the LHS to be an identifier.
-    // This assume we're building without RTTI because LLVM builds that way by
-    // default.  If you build LLVM with RTTI this can be changed to a
-    // dynamic_cast for automatic error checking.
-    VariableExprAST *LHSE = static_cast<VariableExprAST *>(LHS.get());
-    if (!LHSE)
-      return LogErrorV("destination of '=' must be a variable");
     // Codegen the RHS.
     Value *Val = RHS->codegen();
     if (!Val)
       return nullptr;
 
-    // Look up the name.
-    Value *Variable = NamedValues[LHSE->getName()];
-    if (!Variable)
-      return LogErrorV("Unknown variable name");
-
-    Builder.CreateStore(Val, Variable);
-    return Val;
+    // The LHS decides where it goes: a variable, or a lane of one.
+    return LHS->codegenAssign(Val);
   }
 
   Value *L = LHS->codegen();
@@ -791,28 +2423,39 @@ Value *BinaryExprAST::codegen() {
   if (!L || !R)
     return nullptr;
 
+  bool IsBuiltin = Op == '+' || Op == '-' || Op == '*' || Op == '<';
+  if (IsBuiltin && !unifyOperands(L, R))
+    return nullptr;
+
+  // Ints use C's arithmetic: signed overflow is undefined.
+  bool IsInt = L->getType()->isIntegerTy();
   switch (Op) {
   case '+':
-    return Builder.CreateFAdd(L, R, "addtmp");
+    return IsInt ? Builder->CreateNSWAdd(L, R, "addtmp")
+                 : Builder->CreateFAdd(L, R, "addtmp");
   case '-':
-    return Builder.CreateFSub(L, R, "subtmp");
+    return IsInt ? Builder->CreateNSWSub(L, R, "subtmp")
+                 : Builder->CreateFSub(L, R, "subtmp");
   case '*':
-    return Builder.CreateFMul(L, R, "multmp");
+    return IsInt ? Builder->CreateNSWMul(L, R, "multmp")
+                 : Builder->CreateFMul(L, R, "multmp");
   case '<':
-    L = Builder.CreateFCmpULT(L, R, "cmptmp");
-    // Convert bool 0/1 to double 0.0 or 1.0
-    return Builder.CreateUIToFP(L, Type::getDoubleTy(TheContext), "booltmp");
+    L = IsInt ? Builder->CreateICmpSLT(L, R, "cmptmp")
+              : Builder->CreateFCmpULT(L, R, "cmptmp");
+    // Convert bool 0/1 to double 0.0 or 1.0, lane by lane for a vec4.
+    return Builder->CreateUIToFP(
+        L, IsInt ? Builder->getDoubleTy() : R->getType(), "booltmp");
   default:
     break;
   }
 
   // If it wasn't a builtin binary operator, it must be a user defined one. Emit
   // a call to it.
-  Function *F = getFunction(std::string("binary") + Op);
+  Function *F = getFunction(getOperatorID(true, Op));
   assert(F && "binary operator not found!");
 
   Value *Ops[] = {L, R};
-  return Builder.CreateCall(F, Ops, "binop");
+  return createCall(F, Ops, "binop");
 }
 
 Value *CallExprAST::codegen() {
@@ -832,63 +2475,266 @@ Value *CallExprAST::codegen() {
       return nullptr;
   }
 
-  return Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+  return createCall(CalleeF, ArgsV, "calltmp");
+}
+
+bool CallExprAST::codegenReturn() {
+  Value *V = codegen();
+  if (!V)
+    return false;
+
+  // A result that still needs converting is not returned as it is.
+  Function *Caller = Builder->GetInsertBlock()->getParent();
+  auto *Call = cast<CallInst>(V);
+  if (Call->getType() != Caller->getReturnType())
+    return createReturn(Call);
+
+  // Nothing a function allocates can escape it, so no callee ever needs the
+  // caller's frame.  A call to the function itself is made 'musttail': the
+  // prototypes match by definition, and the guarantee lets recursion as deep
+  // as a loop run in constant stack even when no pass turns it into one.
+  Call->setTailCallKind(Call->getCalledFunction() == Caller
+                            ? CallInst::TCK_MustTail
+                            : CallInst::TCK_Tail);
+  Builder->CreateRet(Call);
+  return true;
+}
+
+//===----------------------------------------------------------------------===//
+// Profiling
+//===----------------------------------------------------------------------===//
+
+/// FunctionProfile - The counts for one definition: how often it was entered,
+/// and for each of its conditional branches, in the order codegen emits them,
+/// how often the branch ran and how often it was taken.  Compiled code bumps
+/// the counters in place, so they must never move.
+struct FunctionProfile {
+  uint64_t Entries = 0;
+  std::deque<uint64_t> Counts; // Two per branch: executions, then taken.
+};
+
+/// Counters of the definitions compiled with -profile-generate.  A
+/// redefinition starts from zero; the old code may still run, so its counters
+/// are kept, but they are not written out.
+static StringMap<std::unique_ptr<FunctionProfile>> ProfileCounters;
+static std::vector<std::unique_ptr<FunctionProfile>> RetiredProfileCounters;
+
+/// Counts read with -profile-use.
+static StringMap<FunctionProfile> LoadedProfile;
+
+/// ProfileState - Profiling for the function being generated.
+struct ProfileState {
+  FunctionProfile *Counters = nullptr; // To bump, with -profile-generate.
+  unsigned NextCounter = 0;
+  SmallVector<BranchInst *, 8> Branches; // To weight, with -profile-use.
+};
+static ProfileState CurProfile;
+
+/// getCounterAddress - Counter as a constant pointer, for generated code.
+static Constant *getCounterAddress(uint64_t &Counter) {
+  Type *Int64Ty = Builder->getInt64Ty();
+  return ConstantExpr::getIntToPtr(
+      ConstantInt::get(Int64Ty, (uint64_t)(uintptr_t)&Counter),
+      PointerType::getUnqual(Int64Ty));
+}
+
+/// createCounterIncrement - Add N, an i64, to Counter.
+static void createCounterIncrement(uint64_t &Counter, Value *N) {
+  Constant *Addr = getCounterAddress(Counter);
+  Value *Old = Builder->CreateLoad(Addr, "prof.count");
+  Builder->CreateStore(Builder->CreateAdd(Old, N), Addr);
+}
+
+/// beginProfile - Start profiling the body of F, about to be generated, and
+/// count its entries.  Top-level expressions run once and have no name that
+/// lasts from one run to the next, so they are not profiled.
+static void beginProfile(Function *F) {
+  CurProfile = ProfileState();
+  if (ProfileGenerate.empty() ||
+      F->getName().startswith(Symbols.getName(AnonExprID)))
+    return;
+  std::unique_ptr<FunctionProfile> &Counters = ProfileCounters[F->getName()];
+  if (!Counters)
+    Counters = llvm::make_unique<FunctionProfile>();
+  CurProfile.Counters = Counters.get();
+  createCounterIncrement(Counters->Entries, Builder->getInt64(1));
+}
+
+/// resetProfile - Give Name, which is being (re)defined, new counters.  This
+/// happens when the definition is read, not when it is compiled: with -lazy,
+/// copies of an operator may run before its own code is generated, and they
+/// count towards the same definition.
+static void resetProfile(StringRef Name) {
+  auto I = ProfileCounters.find(Name);
+  if (I == ProfileCounters.end())
+    return;
+  RetiredProfileCounters.push_back(std::move(I->second));
+  ProfileCounters.erase(I);
+}
+
+/// createProfiledCondBr - Branch on Cond like CreateCondBr.  With
+/// -profile-generate the branch counts how often it runs and is taken; with
+/// -profile-use endProfile weights it with the counts of a previous run.
+static BranchInst *createProfiledCondBr(Value *Cond, BasicBlock *True,
+                                        BasicBlock *False) {
+  if (FunctionProfile *Counters = CurProfile.Counters) {
+    unsigned Site = CurProfile.NextCounter;
+    CurProfile.NextCounter += 2;
+    // A copy for another module's inliner bumps the same counters.
+    while (Counters->Counts.size() < CurProfile.NextCounter)
+      Counters->Counts.push_back(0);
+    createCounterIncrement(Counters->Counts[Site], Builder->getInt64(1));
+    createCounterIncrement(Counters->Counts[Site + 1],
+                           Builder->CreateZExt(Cond, Builder->getInt64Ty()));
+  }
+  BranchInst *Br = Builder->CreateCondBr(Cond, True, False);
+  CurProfile.Branches.push_back(Br);
+  return Br;
+}
+
+/// createBranchWeights - Weights for a branch taken Taken times and not taken
+/// NotTaken times, scaled down to fit the 32 bits a weight has.
+static MDNode *createBranchWeights(uint64_t Taken, uint64_t NotTaken) {
+  uint64_t Scale = std::max(Taken, NotTaken) / UINT32_MAX + 1;
+  return MDBuilder(*TheContext)
+      .createBranchWeights(uint32_t(Taken / Scale) + 1,
+                           uint32_t(NotTaken / Scale) + 1);
+}
+
+/// endProfile - Finish F, whose body has been generated: with -profile-use,
+/// give it its entry count and its branches their weights.  A definition
+/// whose branches do not line up with its counts has changed since it was
+/// profiled, and its counts are ignored.
+static void endProfile(Function *F) {
+  auto I = LoadedProfile.find(F->getName());
+  if (I == LoadedProfile.end())
+    return;
+  const FunctionProfile &Profile = I->second;
+  if (Profile.Counts.size() != 2 * CurProfile.Branches.size()) {
+    fprintf(stderr, "profile: '%s' has changed since it was profiled\n",
+            F->getName().str().c_str());
+    LoadedProfile.erase(I);
+    return;
+  }
+
+  F->setEntryCount(Profile.Entries);
+  for (unsigned Idx = 0, E = CurProfile.Branches.size(); Idx != E; ++Idx) {
+    uint64_t Runs = Profile.Counts[2 * Idx];
+    uint64_t Taken = std::min(Profile.Counts[2 * Idx + 1], Runs);
+    if (Runs)
+      CurProfile.Branches[Idx]->setMetadata(
+          LLVMContext::MD_prof, createBranchWeights(Taken, Runs - Taken));
+  }
 }
 
 Value *IfExprAST::codegen() {
-  Value *CondV = Cond->codegen();
+  // Convert condition to a bool by comparing non-equal to 0.
+  Value *CondV = toCondition(Cond->codegen(), "An 'if' condition", "ifcond");
   if (!CondV)
     return nullptr;
 
-  // Convert condition to a bool by comparing non-equal to 0.0.
-  CondV = Builder.CreateFCmpONE(
-      CondV, ConstantFP::get(TheContext, APFloat(0.0)), "ifcond");
-
-  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
 
   // Create blocks for the then and else cases.  Insert the 'then' block at the
   // end of the function.
-  BasicBlock *ThenBB = BasicBlock::Create(TheContext, "then", TheFunction);
-  BasicBlock *ElseBB = BasicBlock::Create(TheContext, "else");
-  BasicBlock *MergeBB = BasicBlock::Create(TheContext, "ifcont");
+  BasicBlock *ThenBB = BasicBlock::Create(*TheContext, "then", TheFunction);
+  BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
+  BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "ifcont");
 
-  Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+  createProfiledCondBr(CondV, ThenBB, ElseBB);
 
   // Emit then value.
-  Builder.SetInsertPoint(ThenBB);
+  Builder->SetInsertPoint(ThenBB);
 
   Value *ThenV = Then->codegen();
   if (!ThenV)
     return nullptr;
 
-  Builder.CreateBr(MergeBB);
   // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
-  ThenBB = Builder.GetInsertBlock();
+  ThenBB = Builder->GetInsertBlock();
 
   // Emit else block.
   TheFunction->getBasicBlockList().push_back(ElseBB);
-  Builder.SetInsertPoint(ElseBB);
+  Builder->SetInsertPoint(ElseBB);
 
   Value *ElseV = Else->codegen();
   if (!ElseV)
     return nullptr;
 
-  Builder.CreateBr(MergeBB);
   // Codegen of 'Else' can change the current block, update ElseBB for the PHI.
-  ElseBB = Builder.GetInsertBlock();
+  ElseBB = Builder->GetInsertBlock();
+
+  // An int on one side and a double on the other meet as a double.  Each
+  // side is converted at the end of its own block.
+  Type *Ty = ThenV->getType();
+  if (Ty->isIntegerTy() && ElseV->getType()->isDoubleTy())
+    Ty = ElseV->getType();
+  ElseV = convertTo(ElseV, Ty, "The 'else' value");
+  if (!ElseV)
+    return nullptr;
+  Builder->CreateBr(MergeBB);
+
+  Builder->SetInsertPoint(ThenBB);
+  ThenV = convertTo(ThenV, Ty, "The 'then' value");
+  Builder->CreateBr(MergeBB);
 
   // Emit merge block.
   TheFunction->getBasicBlockList().push_back(MergeBB);
-  Builder.SetInsertPoint(MergeBB);
-  PHINode *PN = Builder.CreatePHI(Type::getDoubleTy(TheContext), 2, "iftmp");
+  Builder->SetInsertPoint(MergeBB);
+  PHINode *PN = Builder->CreatePHI(Ty, 2, "iftmp");
 
   PN->addIncoming(ThenV, ThenBB);
   PN->addIncoming(ElseV, ElseBB);
   return PN;
 }
 
+/// An 'if' in tail position has no merge block: each side returns on its own,
+/// which keeps both of them in tail position.
+bool IfExprAST::codegenReturn() {
+  Value *CondV = toCondition(Cond->codegen(), "An 'if' condition", "ifcond");
+  if (!CondV)
+    return false;
+
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  BasicBlock *ThenBB = BasicBlock::Create(*TheContext, "then", TheFunction);
+  BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
+  createProfiledCondBr(CondV, ThenBB, ElseBB);
+
+  Builder->SetInsertPoint(ThenBB);
+  if (!Then->codegenReturn())
+    return false;
+
+  TheFunction->getBasicBlockList().push_back(ElseBB);
+  Builder->SetInsertPoint(ElseBB);
+  return Else->codegenReturn();
+}
+
+/// getAccessedPointer - The address I loads from or stores to, if it is a
+/// load or a store.
+static Value *getAccessedPointer(Instruction &I) {
+  if (auto *Load = dyn_cast<LoadInst>(&I))
+    return Load->getPointerOperand();
+  if (auto *Store = dyn_cast<StoreInst>(&I))
+    return Store->getPointerOperand();
+  return nullptr;
+}
+
+/// isVariableAccess - Whether I loads or stores a variable, which lives in an
+/// alloca until mem2reg.
+static bool isVariableAccess(Instruction &I) {
+  Value *Ptr = getAccessedPointer(I);
+  return Ptr && isa<AllocaInst>(Ptr);
+}
+
+/// isCounterAccess - Whether I loads or stores a -profile-generate counter,
+/// the only memory at a constant address.
+static bool isCounterAccess(Instruction &I) {
+  Value *Ptr = getAccessedPointer(I);
+  return Ptr && isa<Constant>(Ptr);
+}
+
 // Output for-loop as:
-//   var = alloca double
+//   var = alloca double (or i64, see below)
 //   ...
 //   start = startexpr
 //   store start -> var
@@ -907,28 +2753,39 @@ Value *IfExprAST::codegen() {
 //   br endcond, loop, endloop
 // outloop:
 Value *ForExprAST::codegen() {
-  Function *TheFunction = Builder.GetInsertBlock()->getParent();
-
-  // Create an alloca for the variable in the entry block.
-  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
 
   // Emit the start code first, without 'variable' in scope.
   Value *StartVal = Start->codegen();
   if (!StartVal)
     return nullptr;
 
+  // A loop that starts from an int, like 'for i = int(0), ...', counts with
+  // one.  After mem2reg an int is a canonical integer induction PHI, which
+  // scalar evolution can compute trip counts for; a double counter defeats
+  // unrolling and vectorization.
+  bool IsInt = StartVal->getType()->isIntegerTy();
+  Type *VarTy = IsInt ? Builder->getInt64Ty() : Builder->getDoubleTy();
+  StartVal = convertTo(StartVal, VarTy, "A loop start value");
+  if (!StartVal)
+    return nullptr;
+
+  // Create an alloca for the variable in the entry block.
+  AllocaInst *Alloca =
+      CreateEntryBlockAlloca(TheFunction, Symbols.getName(VarName), VarTy);
+
   // Store the value into the alloca.
-  Builder.CreateStore(StartVal, Alloca);
+  Builder->CreateStore(StartVal, Alloca);
 
   // Make the new basic block for the loop header, inserting after current
   // block.
-  BasicBlock *LoopBB = BasicBlock::Create(TheContext, "loop", TheFunction);
+  BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
 
   // Insert an explicit fall through from the current block to the LoopBB.
-  Builder.CreateBr(LoopBB);
+  Builder->CreateBr(LoopBB);
 
   // Start insertion in LoopBB.
-  Builder.SetInsertPoint(LoopBB);
+  Builder->SetInsertPoint(LoopBB);
 
   // Within the loop, the variable is defined equal to the PHI node.  If it
   // shadows an existing variable, we have to restore it, so save it now.
@@ -941,41 +2798,76 @@ Value *ForExprAST::codegen() {
   if (!Body->codegen())
     return nullptr;
 
+  // A parallel hint is a promise about the memory the body touches, so take
+  // its accesses now, before the step and end condition are emitted.  The
+  // body's blocks are the ones created since LoopBB.  Variables, this loop's
+  // among them, and the -profile-generate counters do carry values from one
+  // iteration to the next and are left out; mem2reg makes registers of the
+  // variables anyway.
+  SmallVector<Instruction *, 16> BodyAccesses;
+  if (Hints.Parallel)
+    for (auto BB = LoopBB->getIterator(), E = TheFunction->end(); BB != E; ++BB)
+      for (auto &I : *BB)
+        if (I.mayReadOrWriteMemory() && !isVariableAccess(I) &&
+            !isCounterAccess(I))
+          BodyAccesses.push_back(&I);
+
   // Emit the step value.
   Value *StepVal = nullptr;
   if (Step) {
-    StepVal = Step->codegen();
+    StepVal = convertTo(Step->codegen(), VarTy, "A loop step");
     if (!StepVal)
       return nullptr;
   } else {
-    // If not specified, use 1.0.
-    StepVal = ConstantFP::get(TheContext, APFloat(1.0));
+    // If not specified, use 1.
+    StepVal = IsInt ? ConstantInt::get(VarTy, 1) : ConstantFP::get(VarTy, 1.0);
   }
 
-  // Compute the end condition.
-  Value *EndCond = End->codegen();
+  // Compute the end condition, converted to a bool by comparing non-equal
+  // to 0.
+  Value *EndCond =
+      toCondition(End->codegen(), "A loop end condition", "loopcond");
   if (!EndCond)
     return nullptr;
 
   // Reload, increment, and restore the alloca.  This handles the case where
   // the body of the loop mutates the variable.
-  Value *CurVar = Builder.CreateLoad(Alloca, VarName.c_str());
-  Value *NextVar = Builder.CreateFAdd(CurVar, StepVal, "nextvar");
-  Builder.CreateStore(NextVar, Alloca);
-
-  // Convert condition to a bool by comparing non-equal to 0.0.
-  EndCond = Builder.CreateFCmpONE(
-      EndCond, ConstantFP::get(TheContext, APFloat(0.0)), "loopcond");
+  Value *CurVar = Builder->CreateLoad(Alloca, Symbols.getName(VarName));
+  Value *NextVar = IsInt ? Builder->CreateNSWAdd(CurVar, StepVal, "nextvar")
+                         : Builder->CreateFAdd(CurVar, StepVal, "nextvar");
+  Builder->CreateStore(NextVar, Alloca);
 
   // Create the "after loop" block and insert it.
   BasicBlock *AfterBB =
-      BasicBlock::Create(TheContext, "afterloop", TheFunction);
-
-  // Insert the conditional branch into the end of LoopEndBB.
-  Builder.CreateCondBr(EndCond, LoopBB, AfterBB);
+      BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+
+  // Insert the conditional branch into the end of LoopEndBB.  The loop's hints
+  // go on this branch, the latch.
+  BranchInst *Latch = createProfiledCondBr(EndCond, LoopBB, AfterBB);
+  if (!Hints.empty()) {
+    MDNode *LoopID = createLoopID();
+    Latch->setMetadata(LLVMContext::MD_loop, LoopID);
+
+    // A parallel loop is one whose memory accesses all say so.  Nested
+    // parallel loops leave a list of their IDs behind.
+    for (Instruction *I : BodyAccesses) {
+      MDNode *Access = LoopID;
+      if (MDNode *Inner =
+              I->getMetadata(LLVMContext::MD_mem_parallel_loop_access)) {
+        SmallVector<Metadata *, 4> IDs;
+        if (Inner->getNumOperands() && Inner->getOperand(0) == Inner)
+          IDs.push_back(Inner);
+        else
+          IDs.append(Inner->op_begin(), Inner->op_end());
+        IDs.push_back(LoopID);
+        Access = MDNode::get(*TheContext, IDs);
+      }
+      I->setMetadata(LLVMContext::MD_mem_parallel_loop_access, Access);
+    }
+  }
 
   // Any new code will be inserted in AfterBB.
-  Builder.SetInsertPoint(AfterBB);
+  Builder->SetInsertPoint(AfterBB);
 
   // Restore the unshadowed variable.
   if (OldVal)
@@ -984,35 +2876,265 @@ Value *ForExprAST::codegen() {
     NamedValues.erase(VarName);
 
   // for expr always returns 0.0.
-  return Constant::getNullValue(Type::getDoubleTy(TheContext));
+  return Constant::getNullValue(Type::getDoubleTy(*TheContext));
 }
 
-Value *VarExprAST::codegen() {
-  std::vector<AllocaInst *> OldBindings;
+/// createLoopID - The llvm.loop node for this loop's hints: a distinct node
+/// whose first operand is itself, followed by one operand per hint.
+MDNode *ForExprAST::createLoopID() {
+  LLVMContext &Ctx = *TheContext;
+  auto Hint = [&](const char *Name, Constant *Value) -> Metadata * {
+    return MDNode::get(
+        Ctx, {MDString::get(Ctx, Name), ConstantAsMetadata::get(Value)});
+  };
+
+  auto Self = MDNode::getTemporary(Ctx, None);
+  SmallVector<Metadata *, 5> Ops;
+  Ops.push_back(Self.get());
+  if (Hints.Unroll)
+    Ops.push_back(Hint("llvm.loop.unroll.count", Builder->getInt32(Hints.Unroll)));
+  if (Hints.VectorizeWidth) {
+    Ops.push_back(Hint("llvm.loop.vectorize.enable", Builder->getTrue()));
+    Ops.push_back(Hint("llvm.loop.vectorize.width",
+                       Builder->getInt32(Hints.VectorizeWidth)));
+  }
+  if (Hints.Interleave)
+    Ops.push_back(Hint("llvm.loop.interleave.count",
+                       Builder->getInt32(Hints.Interleave)));
 
-  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  MDNode *LoopID = MDNode::getDistinct(Ctx, Ops);
+  LoopID->replaceOperandWith(0, LoopID);
+  return LoopID;
+}
 
-  // Register all variables and emit their initializer.
-  for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
-    const std::string &VarName = VarNames[i].first;
-    ExprAST *Init = VarNames[i].second.get();
+// Output parfor-loop as:
+//   env = alloca { start, captured variables... }
+//   store start, then the value of every variable in scope -> env
+//   trips = ceil(endexpr - start), clamped to [0, MaxParforTrips]
+//   result = kaleidoscope_parfor(outlined, env, trips, reduce)
+//
+// with the body outlined into
+//   double outlined(i8 *env, i64 begin, i64 end):
+//     copy env into variables of its own; acc = 0 (1 for '*')
+//   loop:
+//     var = start + k, for k from begin
+//     acc = acc reduce bodyexpr
+//     br ++k < end, loop, afterloop
+//   afterloop:
+//     ret acc
+//
+// The body sees a copy of each variable: assigning to one only changes that
+// copy, but arrays are shared, so iterations may fill in an array's elements.
+
+/// MaxParforTrips - The most iterations a parfor loop runs: past 2^53 a double
+/// variable stops counting by one, and it keeps the trip count an i64.
+static const double MaxParforTrips = 9007199254740992.0;
+
+/// getParforTrips - The interpreter's trip count, computed as the compiled
+/// code does.  A NaN bound runs no iterations.
+static int64_t getParforTrips(double Start, double End) {
+  double Trips = std::ceil(End - Start);
+  if (!(Trips > 0))
+    return 0;
+  return (int64_t)std::min(Trips, MaxParforTrips);
+}
 
-    // Emit the initializer before adding the variable to scope, this prevents
-    // the initializer from referencing the variable itself, and permits stuff
-    // like this:
-    //  var a = 1 in
-    //    var a = a in ...   # refers to outer 'a'.
-    Value *InitVal;
+Value *ParForExprAST::codegen() {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+  // Emit the start and end code first, without 'variable' in scope.  The
+  // variable counts with an int when it starts from one, as in a 'for' loop.
+  Value *StartVal = Start->codegen();
+  if (!StartVal)
+    return nullptr;
+  bool IsInt = StartVal->getType()->isIntegerTy();
+  Type *VarTy = IsInt ? Builder->getInt64Ty() : Builder->getDoubleTy();
+  StartVal = convertTo(StartVal, VarTy, "A loop start value");
+  if (!StartVal)
+    return nullptr;
+
+  Value *EndVal = toDouble(End->codegen(), "A parfor bound");
+  if (!EndVal)
+    return nullptr;
+  Value *StartD = IsInt ? Builder->CreateSIToFP(StartVal, Builder->getDoubleTy())
+                        : StartVal;
+  Function *Ceil = Intrinsic::getDeclaration(TheModule.get(), Intrinsic::ceil,
+                                             Builder->getDoubleTy());
+  Value *Span = Builder->CreateCall(Ceil, Builder->CreateFSub(EndVal, StartD));
+  // Clamped before the conversion, which is undefined out of range; the
+  // ordered compare sends a NaN to 0.
+  Value *Zero = ConstantFP::get(Builder->getDoubleTy(), 0.0);
+  Value *Max = ConstantFP::get(Builder->getDoubleTy(), MaxParforTrips);
+  Span = Builder->CreateSelect(Builder->CreateFCmpOGT(Span, Zero), Span, Zero);
+  Span = Builder->CreateSelect(Builder->CreateFCmpOLT(Span, Max), Span, Max);
+  Value *Trips = Builder->CreateFPToSI(Span, Builder->getInt64Ty(), "trips");
+
+  // Pack the start value and everything in scope into the environment.  The
+  // loop variable shadows any variable of the same name.
+  SmallVector<std::pair<SymbolID, AllocaInst *>, 8> Captures;
+  for (auto &Var : NamedValues)
+    if (Var.first != VarName)
+      Captures.push_back(Var);
+  std::sort(Captures.begin(), Captures.end(),
+            [](const std::pair<SymbolID, AllocaInst *> &A,
+               const std::pair<SymbolID, AllocaInst *> &B) {
+              return A.first < B.first;
+            });
+
+  SmallVector<Type *, 8> Fields;
+  Fields.push_back(VarTy);
+  for (auto &Var : Captures)
+    Fields.push_back(Var.second->getAllocatedType());
+  StructType *EnvTy = StructType::get(*TheContext, Fields);
+  AllocaInst *Env = CreateEntryBlockAlloca(TheFunction, "parfor.env", EnvTy);
+  Builder->CreateStore(StartVal, Builder->CreateStructGEP(EnvTy, Env, 0));
+  for (unsigned i = 0, e = Captures.size(); i != e; ++i)
+    Builder->CreateStore(
+        Builder->CreateLoad(Captures[i].second, Symbols.getName(Captures[i].first)),
+        Builder->CreateStructGEP(EnvTy, Env, i + 1));
+
+  Function *Outlined = codegenOutlined(EnvTy, Captures, VarTy);
+  if (!Outlined)
+    return nullptr;
+
+  Function *Run = getRuntimeFunction(
+      "kaleidoscope_parfor", Builder->getDoubleTy(),
+      {Outlined->getType(), Builder->getInt8PtrTy(), Builder->getInt64Ty(),
+       Builder->getInt32Ty()});
+  Value *Result = Builder->CreateCall(
+      Run, {Outlined, Builder->CreateBitCast(Env, Builder->getInt8PtrTy()),
+            Trips, Builder->getInt32(Reduce)});
+
+  // Without a reduction, parfor expr returns 0.0 like a for expr.
+  if (!Reduce)
+    return Constant::getNullValue(Type::getDoubleTy(*TheContext));
+  Result->setName("reduced");
+  return Result;
+}
+
+/// codegenOutlined - Emit the body as a function running a range of
+/// iterations, given the environment ParForExprAST::codegen packs.  Runs in
+/// the middle of generating the enclosing function.
+Function *ParForExprAST::codegenOutlined(
+    StructType *EnvTy, ArrayRef<std::pair<SymbolID, AllocaInst *>> Captures,
+    Type *VarTy) {
+  Function *Parent = Builder->GetInsertBlock()->getParent();
+  Type *DoubleTy = Builder->getDoubleTy();
+  Type *Int64Ty = Builder->getInt64Ty();
+  FunctionType *FT = FunctionType::get(
+      DoubleTy, {Builder->getInt8PtrTy(), Int64Ty, Int64Ty}, false);
+  Function *F = Function::Create(FT, Function::InternalLinkage,
+                                 Parent->getName() + ".parfor", TheModule.get());
+  auto AI = F->arg_begin();
+  Value *EnvArg = &*AI++;
+  Value *BeginArg = &*AI++;
+  Value *EndArg = &*AI;
+  EnvArg->setName("env");
+  BeginArg->setName("begin");
+  EndArg->setName("end");
+  setFastMath(F, isFastMath(Parent));
+
+  IRBuilderBase::InsertPoint ParentIP = Builder->saveIP();
+  DenseMap<SymbolID, AllocaInst *> ParentValues;
+  std::swap(ParentValues, NamedValues);
+
+  BasicBlock *Entry = BasicBlock::Create(*TheContext, "entry", F);
+  Builder->SetInsertPoint(Entry);
+  Value *Env = Builder->CreateBitCast(EnvArg, EnvTy->getPointerTo());
+  Value *StartVal =
+      Builder->CreateLoad(Builder->CreateStructGEP(EnvTy, Env, 0), "start");
+  for (unsigned i = 0, e = Captures.size(); i != e; ++i) {
+    StringRef Name = Symbols.getName(Captures[i].first);
+    AllocaInst *Alloca =
+        CreateEntryBlockAlloca(F, Name, EnvTy->getElementType(i + 1));
+    Builder->CreateStore(
+        Builder->CreateLoad(Builder->CreateStructGEP(EnvTy, Env, i + 1), Name),
+        Alloca);
+    NamedValues[Captures[i].first] = Alloca;
+  }
+
+  AllocaInst *Index = CreateEntryBlockAlloca(F, "k", Int64Ty);
+  Builder->CreateStore(BeginArg, Index);
+  AllocaInst *Acc = CreateEntryBlockAlloca(F, "acc", DoubleTy);
+  Builder->CreateStore(ConstantFP::get(DoubleTy, Reduce == '*' ? 1.0 : 0.0),
+                       Acc);
+  AllocaInst *Var = CreateEntryBlockAlloca(F, Symbols.getName(VarName), VarTy);
+  NamedValues[VarName] = Var;
+
+  // The runtime never asks for an empty range, so the body runs before the
+  // first test.
+  BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", F);
+  Builder->CreateBr(LoopBB);
+  Builder->SetInsertPoint(LoopBB);
+  Value *K = Builder->CreateLoad(Index, "k");
+  Builder->CreateStore(
+      VarTy->isIntegerTy()
+          ? Builder->CreateNSWAdd(StartVal, K)
+          : Builder->CreateFAdd(StartVal, Builder->CreateSIToFP(K, DoubleTy)),
+      Var);
+
+  Value *BodyVal = Body->codegen();
+  if (BodyVal && Reduce) {
+    BodyVal = toDouble(BodyVal, "A reduced parfor body");
+    if (BodyVal) {
+      Value *AccVal = Builder->CreateLoad(Acc, "acc");
+      Builder->CreateStore(Reduce == '+'
+                               ? Builder->CreateFAdd(AccVal, BodyVal, "addtmp")
+                               : Builder->CreateFMul(AccVal, BodyVal, "multmp"),
+                           Acc);
+    }
+  }
+
+  if (BodyVal) {
+    Value *NextK = Builder->CreateNSWAdd(Builder->CreateLoad(Index, "k"),
+                                         Builder->getInt64(1), "nextk");
+    Builder->CreateStore(NextK, Index);
+    BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterloop", F);
+    Builder->CreateCondBr(Builder->CreateICmpSLT(NextK, EndArg, "loopcond"),
+                          LoopBB, AfterBB);
+    Builder->SetInsertPoint(AfterBB);
+    Builder->CreateRet(Builder->CreateLoad(Acc, "acc"));
+    verifyFunction(*F);
+  }
+
+  std::swap(ParentValues, NamedValues);
+  Builder->restoreIP(ParentIP);
+
+  if (!BodyVal) {
+    F->eraseFromParent();
+    return nullptr;
+  }
+  OutlinedBodies.push_back(F);
+  return F;
+}
+
+/// bindVars - Emit the initializers and bring the variables into scope,
+/// saving the bindings they shadow in OldBindings.
+bool VarExprAST::bindVars(std::vector<AllocaInst *> &OldBindings) {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+  // Register all variables and emit their initializer.
+  for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
+    SymbolID VarName = VarNames[i].first;
+    ExprAST *Init = VarNames[i].second;
+
+    // Emit the initializer before adding the variable to scope, this prevents
+    // the initializer from referencing the variable itself, and permits stuff
+    // like this:
+    //  var a = 1 in
+    //    var a = a in ...   # refers to outer 'a'.
+    Value *InitVal;
     if (Init) {
       InitVal = Init->codegen();
       if (!InitVal)
-        return nullptr;
+        return false;
     } else { // If not specified, use 0.0.
-      InitVal = ConstantFP::get(TheContext, APFloat(0.0));
+      InitVal = ConstantFP::get(*TheContext, APFloat(0.0));
     }
 
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
-    Builder.CreateStore(InitVal, Alloca);
+    AllocaInst *Alloca = CreateEntryBlockAlloca(
+        TheFunction, Symbols.getName(VarName), InitVal->getType());
+    Builder->CreateStore(InitVal, Alloca);
 
     // Remember the old variable binding so that we can restore the binding when
     // we unrecurse.
@@ -1021,123 +3143,1431 @@ Value *VarExprAST::codegen() {
     // Remember this binding.
     NamedValues[VarName] = Alloca;
   }
+  return true;
+}
+
+/// unbindVars - Pop all our variables from scope.
+void VarExprAST::unbindVars(ArrayRef<AllocaInst *> OldBindings) {
+  for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
+    NamedValues[VarNames[i].first] = OldBindings[i];
+}
+
+Value *VarExprAST::codegen() {
+  std::vector<AllocaInst *> OldBindings;
+  if (!bindVars(OldBindings))
+    return nullptr;
 
   // Codegen the body, now that all vars are in scope.
   Value *BodyVal = Body->codegen();
   if (!BodyVal)
     return nullptr;
 
-  // Pop all our variables from scope.
-  for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
-    NamedValues[VarNames[i].first] = OldBindings[i];
+  unbindVars(OldBindings);
 
   // Return the body computation.
   return BodyVal;
 }
 
+bool VarExprAST::codegenReturn() {
+  std::vector<AllocaInst *> OldBindings;
+  if (!bindVars(OldBindings) || !Body->codegenReturn())
+    return false;
+  unbindVars(OldBindings);
+  return true;
+}
+
 Function *PrototypeAST::codegen() {
-  // Make the function type:  double(double,double) etc.
-  std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(TheContext));
-  FunctionType *FT =
-      FunctionType::get(Type::getDoubleTy(TheContext), Doubles, false);
+  // Make the function type:  double(double,double), vec4(vec4,double) etc.
+  std::vector<Type *> ArgTys;
+  for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    ArgTys.push_back(getType(getArgType(i)));
+  FunctionType *FT = FunctionType::get(getType(ReturnType), ArgTys, false);
+
+  Function *F = Function::Create(FT, Function::ExternalLinkage,
+                                 Symbols.getName(Name), TheModule.get());
+
+  // Set names for all arguments.  An array argument always points at a live
+  // header, which lets LICM hoist its length and data loads out of loops.
+  const DataLayout &DL = TheModule->getDataLayout();
+  unsigned Idx = 0;
+  for (auto &Arg : F->args()) {
+    if (isArray(&Arg)) {
+      StructType *HeaderTy = getArrayType();
+      F->addAttribute(Idx + 1, Attribute::NonNull);
+      F->addAttribute(Idx + 1, Attribute::getWithAlignment(
+                                   *TheContext, DL.getABITypeAlignment(HeaderTy)));
+      F->addDereferenceableAttr(Idx + 1, DL.getTypeAllocSize(HeaderTy));
+    }
+    Arg.setName(Symbols.getName(Args[Idx++]));
+  }
 
-  Function *F =
-      Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+  return F;
+}
 
-  // Set names for all arguments.
-  unsigned Idx = 0;
+/// codegenBody - Emit the body of F, this definition's function.  A memo
+/// function's body goes into an internal function of its own, and F looks
+/// the arguments up in the memo table before calling it:
+///   entry:
+///     store args -> memo.args
+///     br kaleidoscope_memo_find(table, memo.args, memo.result), hit, miss
+///   hit:
+///     ret memo.result
+///   miss:
+///     result = f.memo(args)
+///     kaleidoscope_memo_insert(table, memo.args, result)
+///     ret result
+/// Recursive calls go to F, so each result is computed once.  The table's
+/// address is baked into the code, so -emit-obj leaves memo functions plain.
+bool FunctionAST::codegenBody(Function *F) {
+  if (!Proto->isMemo() || !EmitObj.empty())
+    return codegenPlainBody(F);
+
+  Function *Impl =
+      Function::Create(F->getFunctionType(), Function::InternalLinkage,
+                       F->getName() + ".memo", TheModule.get());
+  auto ImplArg = Impl->arg_begin();
   for (auto &Arg : F->args())
-    Arg.setName(Args[Idx++]);
+    (ImplArg++)->setName(Arg.getName());
+  if (!codegenPlainBody(Impl)) {
+    Impl->eraseFromParent();
+    return false;
+  }
+  OutlinedBodies.push_back(Impl);
+  setFastMath(F, isFastMath(Impl));
+
+  Type *DoubleTy = Builder->getDoubleTy();
+  BasicBlock *Entry = BasicBlock::Create(*TheContext, "entry", F);
+  Builder->SetInsertPoint(Entry);
+  AllocaInst *Args = Builder->CreateAlloca(
+      DoubleTy, Builder->getInt32(std::max<size_t>(F->arg_size(), 1)),
+      "memo.args");
+  AllocaInst *Result = Builder->CreateAlloca(DoubleTy, nullptr, "memo.result");
+  SmallVector<Value *, 8> ArgVals;
+  for (auto &Arg : F->args()) {
+    Builder->CreateStore(
+        &Arg, Builder->CreateGEP(Args, Builder->getInt64(Arg.getArgNo())));
+    ArgVals.push_back(&Arg);
+  }
+
+  Type *Int8PtrTy = Builder->getInt8PtrTy();
+  Type *DoublePtrTy = DoubleTy->getPointerTo();
+  Constant *Table = ConstantExpr::getIntToPtr(
+      Builder->getInt64((uint64_t)(uintptr_t)&getMemoTable()), Int8PtrTy);
+  Function *Find = getRuntimeFunction("kaleidoscope_memo_find",
+                                      Builder->getInt1Ty(),
+                                      {Int8PtrTy, DoublePtrTy, DoublePtrTy});
+  Function *Insert =
+      getRuntimeFunction("kaleidoscope_memo_insert", Builder->getVoidTy(),
+                         {Int8PtrTy, DoublePtrTy, DoubleTy});
+
+  BasicBlock *HitBB = BasicBlock::Create(*TheContext, "hit", F);
+  BasicBlock *MissBB = BasicBlock::Create(*TheContext, "miss", F);
+  Builder->CreateCondBr(Builder->CreateCall(Find, {Table, Args, Result}),
+                        HitBB, MissBB);
+  Builder->SetInsertPoint(HitBB);
+  Builder->CreateRet(Builder->CreateLoad(Result, "memo.result"));
+
+  Builder->SetInsertPoint(MissBB);
+  Value *Computed = Builder->CreateCall(Impl, ArgVals, "calltmp");
+  Builder->CreateCall(Insert, {Table, Args, Computed});
+  Builder->CreateRet(Computed);
+
+  verifyFunction(*F);
+  return true;
+}
+
+/// codegenPlainBody - Emit the body of the definition into F.
+bool FunctionAST::codegenPlainBody(Function *F) {
+  // Fast math is a property of each instruction, so the flags go on the
+  // builder for the whole body.  A copy of a strict definition generated in
+  // the middle of a fastmath one stays strict.
+  IRBuilderBase::FastMathFlagGuard FMFGuard(*Builder);
+  Builder->clearFastMathFlags();
+  bool Fast = FastMath || Proto->isFastMath();
+  if (Fast) {
+    FastMathFlags FMF;
+    FMF.setUnsafeAlgebra();
+    Builder->setFastMathFlags(FMF);
+  }
+  setFastMath(F, Fast);
+
+  // Create a new basic block to start insertion into.
+  BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", F);
+  Builder->SetInsertPoint(BB);
+  beginProfile(F);
+
+  // Record the function arguments in the NamedValues map.
+  NamedValues.clear();
+  unsigned Idx = 0;
+  for (auto &Arg : F->args()) {
+    // Create an alloca for this variable.
+    AllocaInst *Alloca = CreateEntryBlockAlloca(F, Arg.getName(), Arg.getType());
+
+    // Store the initial value into the alloca.
+    Builder->CreateStore(&Arg, Alloca);
+
+    // Add arguments to variable symbol table.
+    NamedValues[Proto->getArgs()[Idx++]] = Alloca;
+  }
+
+  // The body returns its value itself, from every branch that ends it.
+  if (!Body->codegenReturn())
+    return false;
+  endProfile(F);
+
+  // Validate the generated code, checking for consistency.
+  verifyFunction(*F);
+  return true;
+}
+
+/// countInstructions - The number of IR instructions in F, or in all of M.
+static uint64_t countInstructions(const Function &F) {
+  uint64_t N = 0;
+  for (auto &BB : F)
+    N += BB.size();
+  return N;
+}
+
+static uint64_t countInstructions(const Module &M) {
+  uint64_t N = 0;
+  for (auto &F : M)
+    N += countInstructions(F);
+  return N;
+}
+
+/// recordOptimization - Account for an optimizer run that took code of Before
+/// instructions down (or up) to After.
+static void recordOptimization(uint64_t Before, uint64_t After) {
+  std::lock_guard<std::mutex> Lock(PhaseMutex);
+  NumInstsBeforeOpt += Before;
+  NumInstsAfterOpt += After;
+}
+
+/// How deep InlineCopies goes into copies called by inlined copies.  Copies
+/// of mutually recursive operators call each other without end.
+static const unsigned MaxCopyInlineDepth = 8;
+
+/// InlineCopies - Inline F's calls to copies of definitions from other
+/// modules.  The -O pipelines have an inliner for this, but the tutorial's
+/// function passes do not.
+static void InlineCopies(Function &F) {
+  bool Changed = true;
+  for (unsigned Depth = 0; Changed && Depth != MaxCopyInlineDepth; ++Depth) {
+    SmallVector<CallInst *, 8> Calls;
+    for (auto &BB : F)
+      for (auto &I : BB)
+        if (auto *Call = dyn_cast<CallInst>(&I))
+          if (Function *Callee = Call->getCalledFunction())
+            if (!Callee->isDeclaration() &&
+                Callee->hasFnAttribute(Attribute::AlwaysInline))
+              Calls.push_back(Call);
+
+    // Inlined bodies may call further copies.
+    Changed = false;
+    for (CallInst *Call : Calls) {
+      InlineFunctionInfo IFI;
+      Changed |= InlineFunction(Call, IFI);
+    }
+  }
+}
+
+/// markSmallForInlining - Have F always inlined if it is small, as
+/// generated, and does not call itself: a recursive body would go on
+/// inlining into itself.  The -O inliner weighs the rest.
+static void markSmallForInlining(Function *F) {
+  unsigned Size = 0;
+  for (auto &BB : *F)
+    Size += BB.size();
+  if (Size <= SmallDefinitionSize &&
+      none_of(F->users(), [F](User *U) {
+        return cast<Instruction>(U)->getFunction() == F;
+      }))
+    F->addFnAttr(Attribute::AlwaysInline);
+}
+
+/// codegenInlinable - Emit this definition, already compiled into another
+/// module, into the current one as an available_externally copy: the inliner
+/// may use its body, and calls that are not inlined still go to the compiled
+/// function.  Runs in the middle of generating the caller.
+Function *FunctionAST::codegenInlinable() {
+  Function *F = Proto->codegen();
+
+  IRBuilderBase::InsertPoint CallerIP = Builder->saveIP();
+  DenseMap<SymbolID, AllocaInst *> CallerValues;
+  ProfileState CallerProfile;
+  // The caller's outlined bodies while the copy is generated; the copy's
+  // after.  The copy stays in the module should the caller fail, so its
+  // bodies must not be dropped with the caller's.
+  SmallVector<Function *, 4> Bodies;
+  std::swap(CallerValues, NamedValues);
+  std::swap(CallerProfile, CurProfile);
+  std::swap(Bodies, OutlinedBodies);
+  bool Generated = codegenBody(F);
+  std::swap(CallerValues, NamedValues);
+  std::swap(CallerProfile, CurProfile);
+  std::swap(Bodies, OutlinedBodies);
+  Builder->restoreIP(CallerIP);
+
+  // Should the body not generate after all, a declaration does as well.
+  if (!Generated) {
+    F->deleteBody();
+    for (Function *Outlined : reverse(Bodies)) // Users first.
+      Outlined->eraseFromParent();
+    return F;
+  }
+
+  // The copy itself is only optimized once inlined, but calls to its
+  // outlined bodies are not inlined.  This runs within the caller's codegen
+  // phase, which its time is counted in.
+  if (!optimizeWholeModules() && !Bodies.empty()) {
+    uint64_t Before = 0, After = 0;
+    for (Function *Outlined : Bodies) {
+      Before += countInstructions(*Outlined);
+      InlineCopies(*Outlined);
+      TheFPM->run(*Outlined);
+      After += countInstructions(*Outlined);
+    }
+    recordOptimization(Before, After);
+  }
+
+  F->setLinkage(GlobalValue::AvailableExternallyLinkage);
+  markSmallForInlining(F);
+  return F;
+}
+
+Function *FunctionAST::codegen() {
+  // Record a copy of the prototype in the FunctionProtos map, so later modules
+  // can declare the function.  The AST keeps its own, for the interpreter and
+  // should -lazy have to generate it again.
+  auto &P = *Proto;
+  FunctionProtos[P.getName()] = llvm::make_unique<PrototypeAST>(P);
+
+  // A redefinition: modules from now on must not inline the old body.
+  auto II = InlinableDefinitions.find(P.getName());
+  if (II != InlinableDefinitions.end() && II->second.get() != this)
+    InlinableDefinitions.erase(II);
+
+  Function *TheFunction = getFunction(P.getName());
+  if (!TheFunction)
+    return nullptr;
+
+  // The module may already hold a copy of the body to inline; the
+  // definition takes its place.
+  if (!TheFunction->isDeclaration()) {
+    TheFunction->deleteBody();
+    TheFunction->removeFnAttr(Attribute::AlwaysInline);
+  }
+
+  // If this is an operator, install it.
+  if (P.isBinaryOp())
+    BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+
+  bool Generated;
+  {
+    PhaseTimer Timer(PhaseCodegen);
+    Generated = codegenBody(TheFunction);
+  }
+  if (Generated) {
+    // The whole program is in this module, so later definitions call this
+    // one directly rather than a copy.
+    if (WholeProgram)
+      markSmallForInlining(TheFunction);
+
+    // Run the optimizer on the function, unless the whole module is optimized
+    // in one go when it is handed to the JIT.
+    if (!optimizeWholeModules()) {
+      PhaseTimer Timer(PhaseOptimize);
+      uint64_t Before = countInstructions(*TheFunction);
+      uint64_t After = 0;
+      for (Function *Outlined : OutlinedBodies) {
+        Before += countInstructions(*Outlined);
+        InlineCopies(*Outlined);
+        TheFPM->run(*Outlined);
+        After += countInstructions(*Outlined);
+      }
+      InlineCopies(*TheFunction);
+      TheFPM->run(*TheFunction);
+      recordOptimization(Before, After + countInstructions(*TheFunction));
+    }
+    OutlinedBodies.clear();
+
+    return TheFunction;
+  }
+
+  // Error reading body, remove function.  With -lazy, a definition compiled
+  // before it may already call it; that leaves a declaration, in a module
+  // MaterializePendingDefinitions' caller drops anyway.
+  TheFunction->deleteBody();
+  for (Function *Outlined : reverse(OutlinedBodies)) // Users first.
+    Outlined->eraseFromParent();
+  OutlinedBodies.clear();
+  if (TheFunction->use_empty())
+    TheFunction->eraseFromParent();
+  FunctionProtos.erase(P.getName());
+
+  if (P.isBinaryOp())
+    BinopPrecedence.erase(P.getOperatorName());
+  return nullptr;
+}
+
+//===----------------------------------------------------------------------===//
+// Object cache
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+/// DiskObjectCache - Keeps the objects the JIT compiles in a directory so later
+/// runs can load them instead of running codegen again.  An object is keyed by
+/// the MD5 of the module's (already optimized) IR together with the target
+/// triple, CPU and optimization level.
+class DiskObjectCache : public ObjectCache {
+  std::string Dir;
+  std::string KeyPrefix;
+
+  // getObject() misses are followed by notifyObjectCompiled() for the same
+  // module; remember the path so the IR is only hashed once.
+  const Module *LastModule = nullptr;
+  SmallString<128> LastPath;
+
+  void computeCachePath(const Module *M) {
+    std::string IR;
+    raw_string_ostream OS(IR);
+    M->print(OS, nullptr);
+    OS.flush();
+
+    MD5 Hash;
+    Hash.update(KeyPrefix);
+    Hash.update(IR);
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    SmallString<32> Key;
+    MD5::stringifyResult(Result, Key);
+
+    LastPath = Dir;
+    sys::path::append(LastPath, Key + ".o");
+    LastModule = M;
+  }
+
+public:
+  unsigned Hits = 0;
+  unsigned Misses = 0;
+
+  DiskObjectCache(std::string Dir, std::string KeyPrefix)
+      : Dir(std::move(Dir)), KeyPrefix(std::move(KeyPrefix)) {
+    if (std::error_code EC = sys::fs::create_directories(this->Dir))
+      fprintf(stderr, "Error: can't create cache directory '%s': %s\n",
+              this->Dir.c_str(), EC.message().c_str());
+  }
+
+  std::unique_ptr<MemoryBuffer> getObject(const Module *M) override {
+    computeCachePath(M);
+    auto BufOrErr = MemoryBuffer::getFile(LastPath);
+    if (!BufOrErr) {
+      ++Misses;
+      return nullptr;
+    }
+    ++Hits;
+    LastModule = nullptr;
+    return std::move(*BufOrErr);
+  }
+
+  void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override {
+    if (M != LastModule)
+      computeCachePath(M);
+    LastModule = nullptr;
+
+    // Write to a temporary and rename it into place, so a run sharing the
+    // directory never loads a partly written object.
+    int FD;
+    SmallString<128> TmpPath;
+    if (sys::fs::createUniqueFile(LastPath + ".tmp%%%%%%", FD, TmpPath))
+      return;
+    {
+      raw_fd_ostream OS(FD, /*shouldClose=*/true);
+      OS << Obj.getBuffer();
+    }
+    if (sys::fs::rename(TmpPath, LastPath))
+      sys::fs::remove(TmpPath);
+  }
+};
+
+} // end anonymous namespace
+
+static std::unique_ptr<DiskObjectCache> TheObjectCache;
+
+//===----------------------------------------------------------------------===//
+// Profile files
+//===----------------------------------------------------------------------===//
+
+// A profile is a line of text per definition: its name, how often it was
+// entered, and then two counts per conditional branch, as in FunctionProfile.
+
+/// The summary of the -profile-use counts every module carries.  It lets
+/// passes like the inliner tell hot code from cold.
+static std::unique_ptr<ProfileSummary> TheProfileSummary;
+
+/// buildProfileSummary - Summarize the counts in LoadedProfile the way an
+/// instrumented profile is: for each cutoff, the smallest count among the
+/// hottest counts that make up that share (in millionths) of the total.
+static std::unique_ptr<ProfileSummary> buildProfileSummary() {
+  static const uint32_t Cutoffs[] = {10000,  100000, 200000, 300000, 400000,
+                                     500000, 600000, 700000, 800000, 900000,
+                                     950000, 990000, 999000, 999900, 999990,
+                                     999999};
+  std::vector<uint64_t> Counts;
+  uint64_t MaxFunctionCount = 0, MaxInternalCount = 0;
+  for (auto &Entry : LoadedProfile) {
+    const FunctionProfile &Profile = Entry.getValue();
+    Counts.push_back(Profile.Entries);
+    MaxFunctionCount = std::max(MaxFunctionCount, Profile.Entries);
+    // The blocks a branch leads to run as often as it goes their way.
+    for (unsigned Idx = 0; Idx + 1 < Profile.Counts.size(); Idx += 2) {
+      uint64_t Taken = std::min(Profile.Counts[Idx + 1], Profile.Counts[Idx]);
+      Counts.push_back(Taken);
+      Counts.push_back(Profile.Counts[Idx] - Taken);
+      MaxInternalCount = std::max(MaxInternalCount, Counts.end()[-1]);
+      MaxInternalCount = std::max(MaxInternalCount, Counts.end()[-2]);
+    }
+  }
+  std::sort(Counts.begin(), Counts.end(), std::greater<uint64_t>());
+  uint64_t Total = 0;
+  for (uint64_t Count : Counts)
+    Total += Count;
+
+  SummaryEntryVector Detailed;
+  uint64_t Sum = 0;
+  unsigned Idx = 0;
+  for (uint32_t Cutoff : Cutoffs) {
+    double Needed = (double)Total * Cutoff / 1000000;
+    while (Idx < Counts.size() && Sum < Needed)
+      Sum += Counts[Idx++];
+    Detailed.push_back(ProfileSummaryEntry(Cutoff, Idx ? Counts[Idx - 1] : 0,
+                                           Idx));
+  }
+  return llvm::make_unique<ProfileSummary>(
+      ProfileSummary::PSK_Instr, Detailed, Total,
+      Counts.empty() ? 0 : Counts.front(), MaxInternalCount, MaxFunctionCount,
+      Counts.size(), LoadedProfile.size());
+}
+
+/// loadProfile - Read the counts in Path into LoadedProfile.
+static bool loadProfile(StringRef Path) {
+  auto BufOrErr = MemoryBuffer::getFile(Path);
+  if (!BufOrErr) {
+    fprintf(stderr, "Error: can't read profile '%s': %s\n", Path.str().c_str(),
+            BufOrErr.getError().message().c_str());
+    return false;
+  }
+
+  SmallVector<StringRef, 64> Lines, Fields;
+  (*BufOrErr)->getBuffer().split(Lines, '\n', -1, /*KeepEmpty=*/false);
+  for (StringRef Line : Lines) {
+    Fields.clear();
+    Line.split(Fields, ' ', -1, /*KeepEmpty=*/false);
+    FunctionProfile Profile;
+    bool Bad = Fields.size() < 2 || Fields.size() % 2 != 0 ||
+               Fields[1].getAsInteger(10, Profile.Entries);
+    for (unsigned Idx = 2; !Bad && Idx < Fields.size(); ++Idx) {
+      Profile.Counts.push_back(0);
+      Bad = Fields[Idx].getAsInteger(10, Profile.Counts.back());
+    }
+    if (Bad) {
+      fprintf(stderr, "Error: malformed profile '%s'\n", Path.str().c_str());
+      LoadedProfile.clear();
+      return false;
+    }
+    LoadedProfile[Fields[0]] = std::move(Profile);
+  }
+
+  TheProfileSummary = buildProfileSummary();
+  return true;
+}
+
+/// writeProfile - Write the -profile-generate counters to Path.
+static void writeProfile(StringRef Path) {
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::F_Text);
+  if (EC) {
+    fprintf(stderr, "Error: can't write profile '%s': %s\n",
+            Path.str().c_str(), EC.message().c_str());
+    return;
+  }
+  for (auto &Entry : ProfileCounters) {
+    OS << Entry.getKey() << ' ' << Entry.getValue()->Entries;
+    for (uint64_t Count : Entry.getValue()->Counts)
+      OS << ' ' << Count;
+    OS << '\n';
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Top-Level parsing and JIT Driver
+//===----------------------------------------------------------------------===//
+
+/// Compile-time accounting for -report-compile-time.
+static double CompileSeconds;
+static unsigned NumDefinitions;
+static unsigned NumModules;
+
+/// Whether evaluated expressions print their result; off for -bench=repl.
+static bool EchoResults = true;
+
+static void AddFunctionPasses(legacy::FunctionPassManager &FPM) {
+  // Promote allocas to registers.
+  FPM.add(createPromoteMemoryToRegisterPass());
+  // Do simple "peephole" optimizations and bit-twiddling optzns.
+  FPM.add(createInstructionCombiningPass());
+  // Reassociate expressions.
+  FPM.add(createReassociatePass());
+  // Eliminate Common SubExpressions.
+  FPM.add(createGVNPass());
+  // Simplify the control flow graph (deleting unreachable blocks, etc).
+  FPM.add(createCFGSimplificationPass());
+  // Turn self-recursive tail calls into loops.
+  FPM.add(createTailCallEliminationPass());
+}
+
+static std::unique_ptr<Module> CreateModule(StringRef Name,
+                                            LLVMContext &Context) {
+  auto M = llvm::make_unique<Module>(Name, Context);
+  M->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
+  M->setTargetTriple(TheJIT->getTargetMachine().getTargetTriple().str());
+  if (TheProfileSummary)
+    M->setProfileSummary(TheProfileSummary->getMD(Context));
+  return M;
+}
+
+/// ReportLoopTransform - Diagnostic handler for -report-loops.  Loop passes
+/// report what they did as optimization remarks, which LLVM drops unless
+/// -pass-remarks asks for them; this prints the ones saying a loop was
+/// vectorized or unrolled, whatever the filters say, and handles everything
+/// else the way the default handler would.
+static void ReportLoopTransform(const DiagnosticInfo &DI, void *) {
+  static std::mutex OutputMutex; // Compile threads report concurrently.
+  std::lock_guard<std::mutex> Lock(OutputMutex);
+
+  if (auto *Remark = dyn_cast<DiagnosticInfoOptimizationBase>(&DI)) {
+    StringRef Pass = Remark->getPassName();
+    if (DI.getKind() == DK_OptimizationRemark &&
+        (Pass == "loop-vectorize" || Pass == "loop-unroll")) {
+      errs() << "loops: " << Remark->getFunction().getName() << ": "
+             << Remark->getMsg() << "\n";
+      return;
+    }
+    if (DI.getSeverity() == DS_Remark && !Remark->isEnabled())
+      return;
+  }
+
+  errs() << LLVMContext::getDiagnosticMessagePrefix(DI.getSeverity()) << ": ";
+  DiagnosticPrinterRawOStream DP(errs());
+  DI.print(DP);
+  errs() << "\n";
+  if (DI.getSeverity() == DS_Error)
+    exit(1);
+}
+
+/// CreateContext - A context for a module on its way to the JIT.
+static std::unique_ptr<LLVMContext> CreateContext() {
+  auto Context = llvm::make_unique<LLVMContext>();
+  if (ReportLoops)
+    Context->setDiagnosticHandler(ReportLoopTransform, nullptr);
+  return Context;
+}
+
+static void InitializeModuleAndPassManager() {
+  // A module that is being dropped goes before the context it lives in.
+  TheFPM.reset();
+  TheModule.reset();
+
+  // Open a new module, in a context of its own so that it can be compiled on
+  // another thread while the next one is being built.
+  TheContext = CreateContext();
+  Builder = llvm::make_unique<IRBuilder<>>(*TheContext);
+  TheModule = CreateModule("my cool jit", *TheContext);
+
+  // Create a new pass manager attached to it.
+  TheFPM = llvm::make_unique<legacy::FunctionPassManager>(TheModule.get());
+  AddFunctionPasses(*TheFPM);
+  TheFPM->doInitialization();
+}
+
+/// AddStandardPasses - Fill FPM and MPM with LLVM's standard pipeline for the
+/// -O level, the same one clang and opt use.  TM, the machine the module will
+/// be compiled for, drives the cost models of the vectorizers and unroller.
+static void AddStandardPasses(legacy::FunctionPassManager &FPM,
+                              legacy::PassManager &MPM, Module &M,
+                              TargetMachine &TM) {
+  unsigned Level = getOptLevel();
+  PassManagerBuilder PMB;
+  PMB.OptLevel = Level;
+  PMB.LibraryInfo = new TargetLibraryInfoImpl(Triple(M.getTargetTriple()));
+  if (Level > 1)
+    PMB.Inliner = createFunctionInliningPass(Level, 0);
+  else
+    PMB.Inliner = createAlwaysInlinerLegacyPass();
+  PMB.DisableUnrollLoops = Level == 0;
+  PMB.LoopVectorize = Level > 1;
+  PMB.SLPVectorize = Level > 1;
+
+  // Array bounds checks are range checks on the loop's induction variable;
+  // IRCE takes them out of the main loop so the vectorizer can have it.  It
+  // has to see them before IndVarSimplify rewrites them into exit tests, so
+  // it runs before the module passes, after LICM has hoisted the lengths.
+  if (Level > 1) {
+    PMB.addExtension(PassManagerBuilder::EP_ModuleOptimizerEarly,
+                     [](const PassManagerBuilder &,
+                        legacy::PassManagerBase &PM) {
+                       PM.add(createLICMPass());
+                       PM.add(createInductiveRangeCheckEliminationPass());
+                     });
+    // Checks IRCE leaves alone may become loop-invariant once IndVarSimplify
+    // has run, e.g. a loop over x bounded by len(x) can only fail on its
+    // first trip.  Unswitching then gives the vectorizer a loop without them.
+    PMB.addExtension(PassManagerBuilder::EP_LoopOptimizerEnd,
+                     [](const PassManagerBuilder &,
+                        legacy::PassManagerBase &PM) {
+                       PM.add(createLoopUnswitchPass());
+                     });
+  }
+
+  FPM.add(createTargetTransformInfoWrapperPass(TM.getTargetIRAnalysis()));
+  MPM.add(createTargetTransformInfoWrapperPass(TM.getTargetIRAnalysis()));
+  PMB.populateFunctionPassManager(FPM);
+  PMB.populateModulePassManager(MPM);
+}
+
+/// OptimizeModule - Optimize all of M on its way to the JIT: the tutorial's
+/// function passes by default, or the standard pipeline for the -O level.
+/// Only touches M, its context and TM, so it is safe to run on a compile
+/// thread.
+static void OptimizeModule(Module &M, TargetMachine &TM) {
+  PhaseTimer Timer(PhaseOptimize);
+  uint64_t Before = countInstructions(M);
+  legacy::FunctionPassManager FPM(&M);
+  legacy::PassManager MPM;
+  // A -batch program in a single module is all there is: only its top-level
+  // expressions are called from outside, so everything else may be changed
+  // or dropped by the interprocedural passes.  The main thread may be
+  // interning names meanwhile, so Symbols is not read here.
+  if (WholeProgram && EmitObj.empty() && hasOptLevel())
+    MPM.add(createInternalizePass([](const GlobalValue &GV) {
+      return GV.getName().startswith(AnonExprName);
+    }));
+  if (hasOptLevel())
+    AddStandardPasses(FPM, MPM, M, TM);
+  else
+    AddFunctionPasses(FPM);
+
+  // The tutorial's passes have no inliner; see InlineCopies.
+  FPM.doInitialization();
+  for (auto &F : M)
+    if (!F.isDeclaration()) {
+      if (!hasOptLevel())
+        InlineCopies(F);
+      FPM.run(F);
+    }
+  FPM.doFinalization();
+  MPM.run(M);
+  recordOptimization(Before, countInstructions(M));
+}
+
+/// ExprSlot - A module that REPL top-level expressions are generated into one
+/// at a time.  It keeps its context and pass managers, so evaluating a line
+/// does not have to build them again; only the expression's IR is thrown away
+/// once it has been compiled.
+struct ExprSlot {
+  std::unique_ptr<LLVMContext> Context;
+  std::unique_ptr<IRBuilder<>> Builder;
+  std::unique_ptr<Module> M;
+  std::unique_ptr<legacy::FunctionPassManager> FPM;
+  std::unique_ptr<legacy::PassManager> MPM; // Used when optimizeWholeModules().
+  unsigned NumCleared = 0;
+};
+
+static ExprSlot TheExprSlot;
+
+/// The slot's context keeps every type and constant the expressions in it
+/// ever used, so it is replaced by a fresh one after this many.
+static const unsigned ExprSlotContextLifetime = 1000;
+
+static void InitializeExprSlot() {
+  ExprSlot &S = TheExprSlot;
+  S.NumCleared = 0;
+  S.Context = CreateContext();
+  S.Builder = llvm::make_unique<IRBuilder<>>(*S.Context);
+  S.M = CreateModule("expression slot", *S.Context);
+  S.FPM = llvm::make_unique<legacy::FunctionPassManager>(S.M.get());
+  S.MPM = llvm::make_unique<legacy::PassManager>();
+  if (hasOptLevel())
+    AddStandardPasses(*S.FPM, *S.MPM, *S.M, TheJIT->getTargetMachine());
+  else
+    AddFunctionPasses(*S.FPM);
+  S.FPM->doInitialization();
+}
+
+/// SwapExprSlot - Exchange the slot with the current module, so codegen goes
+/// into the slot until the next call.
+static void SwapExprSlot() {
+  std::swap(TheContext, TheExprSlot.Context);
+  std::swap(Builder, TheExprSlot.Builder);
+  std::swap(TheModule, TheExprSlot.M);
+  std::swap(TheFPM, TheExprSlot.FPM);
+}
+
+/// DestroyExprSlot - Free the slot, the module before the context that owns
+/// its types.
+static void DestroyExprSlot() {
+  ExprSlot &S = TheExprSlot;
+  S.MPM.reset();
+  S.FPM.reset();
+  S.M.reset();
+  S.Builder.reset();
+  S.Context.reset();
+}
+
+/// ClearExprSlot - Erase everything the last expression put in the slot.
+static void ClearExprSlot() {
+  if (++TheExprSlot.NumCleared == ExprSlotContextLifetime) {
+    DestroyExprSlot();
+    InitializeExprSlot();
+    return;
+  }
+
+  // Drop every reference first, so nothing is erased while still in use.
+  Module &M = *TheExprSlot.M;
+  for (auto &F : M)
+    F.dropAllReferences();
+  for (auto &GV : M.globals())
+    GV.dropAllReferences();
+  for (auto &GA : M.aliases())
+    GA.dropAllReferences();
+  while (!M.empty())
+    M.begin()->eraseFromParent();
+  while (!M.global_empty())
+    M.global_begin()->eraseFromParent();
+  while (!M.alias_empty())
+    M.alias_begin()->eraseFromParent();
+}
+
+/// SubmitModule - Hand the current module and its context to the JIT and open
+/// a fresh one.  With -compile-threads the module is optimized and compiled in
+/// the background, and only waited for once a symbol is looked up.
+static void SubmitModule() {
+  if (CompileThreads) {
+    TheJIT->addModuleAsync(std::move(TheModule), std::move(TheContext),
+                           OptimizeModule);
+  } else {
+    if (optimizeWholeModules())
+      OptimizeModule(*TheModule, TheJIT->getTargetMachine());
+    PhaseTimer Timer(PhaseJIT);
+    TheJIT->addModule(std::move(TheModule), std::move(TheContext));
+  }
+  ++NumModules;
+  InitializeModuleAndPassManager();
+}
+
+/// Top-level expressions compiled in -batch mode, in source order, waiting to
+/// be run once the whole input has been compiled.
+static std::vector<std::string> BatchExprs;
+static unsigned BatchModuleDefinitions;
+/// Expressions named so far; the names must stay unique across modules, as a
+/// later module's lookup would otherwise find an earlier module's expression.
+static unsigned NumBatchExprs;
+
+/// MaterializePendingDefinitions - Compile the deferred definitions that were
+/// referenced since the last call into the current module, along with the
+/// ones they refer to in turn.  Should one fail, the module is of no use:
+/// every definition stays deferred, and the caller drops the module.
+static bool MaterializePendingDefinitions() {
+  SmallVector<SymbolID, 8> Compiled;
+  while (!PendingDefinitions.empty()) {
+    SymbolID Name = PendingDefinitions.back();
+    PendingDefinitions.pop_back();
+
+    auto LI = LazyDefinitions.find(Name);
+    if (LI == LazyDefinitions.end() || is_contained(Compiled, Name))
+      continue; // Already compiled.
+    if (!LI->second->codegen()) {
+      PendingDefinitions.clear();
+      for (SymbolID Done : Compiled)
+        FunctionProtos.erase(Done);
+      return false;
+    }
+    Compiled.push_back(Name);
+  }
+
+  for (SymbolID Name : Compiled) {
+    auto LI = LazyDefinitions.find(Name);
+    auto FnAST = std::move(LI->second);
+    LazyDefinitions.erase(LI);
+    // The interpreter may still be running this definition further up the
+    // stack, so its AST has to stay around.
+    if (isInlinable(*FnAST))
+      InlinableDefinitions[Name] = std::move(FnAST);
+    else if (Tiered)
+      PromotedDefinitions.push_back(std::move(FnAST));
+    ++NumDefinitions;
+  }
+  return true;
+}
+
+/// FlushBatchModule - Hand the current batch module to the JIT in one piece.
+static void FlushBatchModule() {
+  if (TheModule->empty())
+    return;
+
+  auto Start = Clock::now();
+  if (MaterializePendingDefinitions()) {
+    SubmitModule();
+  } else {
+    // The expressions in the module call a definition that did not compile.
+    BatchExprs.erase(remove_if(BatchExprs,
+                               [](const std::string &Name) {
+                                 return TheModule->getFunction(Name);
+                               }),
+                     BatchExprs.end());
+    InitializeModuleAndPassManager();
+  }
+  BatchModuleDefinitions = 0;
+  CompileSeconds += secondsSince(Start);
+}
+
+/// RunBatchExprs - Flush the last batch module and run the top-level
+/// expressions of the whole input.  They are held back until now so that
+/// -compile-threads can keep compiling modules while parsing continues.
+static void RunBatchExprs() {
+  FlushBatchModule();
+
+  // Resolve every expression up front so linking is counted as compile time.
+  auto Start = Clock::now();
+  std::vector<double (*)()> Exprs;
+  for (auto &Name : BatchExprs) {
+    auto ExprSymbol = TheJIT->findSymbol(Name);
+    assert(ExprSymbol && "Function not found");
+    Exprs.push_back((double (*)())(intptr_t)ExprSymbol.getAddress());
+  }
+  BatchExprs.clear();
+  // Waiting for compile threads and linking their objects.
+  addPhaseTime(PhaseJIT, secondsSince(Start), 0);
+  CompileSeconds += secondsSince(Start);
+
+  for (auto *FP : Exprs) {
+    auto RunStart = Clock::now();
+    double Result = FP();
+    recordExecution(secondsSince(RunStart));
+    fprintf(stderr, "Evaluated to %f\n", Result);
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Object files
+//===----------------------------------------------------------------------===//
+
+// With -emit-obj the input is compiled like a -batch program, but the module
+// is written out as an object file instead of being handed to the JIT.  A
+// header next to it declares the definitions C can call.
+
+/// Top-level expressions -emit-obj left out.
+static unsigned NumSkippedExprs;
+
+/// createObjectTargetMachine - A TargetMachine for the host like the JIT's,
+/// but generating position-independent code, so the object can go into a
+/// shared library as well as an executable.
+static std::unique_ptr<TargetMachine> createObjectTargetMachine() {
+  TargetMachine &JITTM = TheJIT->getTargetMachine();
+  std::string Error;
+  const Target *TheTarget =
+      TargetRegistry::lookupTarget(JITTM.getTargetTriple().str(), Error);
+  if (!TheTarget) {
+    fprintf(stderr, "Error: %s\n", Error.c_str());
+    return nullptr;
+  }
+  std::unique_ptr<TargetMachine> TM(TheTarget->createTargetMachine(
+      JITTM.getTargetTriple().str(), JITTM.getTargetCPU(),
+      JITTM.getTargetFeatureString(), JITTM.Options, Reloc::PIC_));
+  TM->setOptLevel(JITTM.getOptLevel());
+  return TM;
+}
+
+/// getCTypeName - The C spelling of Ty, or null if C has no plain type for it.
+static const char *getCTypeName(Type *Ty) {
+  if (Ty->isDoubleTy())
+    return "double";
+  if (Ty->isIntegerTy(64))
+    return "int64_t";
+  return nullptr;
+}
+
+/// isCIdentifier - Whether Name can be spelled in C; operators cannot.
+static bool isCIdentifier(StringRef Name) {
+  if (Name.empty() || isdigit(Name[0]))
+    return false;
+  for (char C : Name)
+    if (!isalnum(C) && C != '_')
+      return false;
+  return true;
+}
+
+/// writeHeader - Declare the functions M defines in a C header at Path.
+static bool writeHeader(Module &M, StringRef Path) {
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::F_Text);
+  if (EC) {
+    fprintf(stderr, "Error: can't write '%s': %s\n", Path.str().c_str(),
+            EC.message().c_str());
+    return false;
+  }
+
+  std::string Guard = "KALEIDOSCOPE_";
+  for (char C : sys::path::filename(Path))
+    Guard += isalnum(C) ? toupper(C) : '_';
+
+  OS << "/* Definitions compiled by toy-7 from " << InputFilename << ". */\n"
+     << "#ifndef " << Guard << "\n#define " << Guard << "\n\n"
+     << "#include <stdint.h>\n\n"
+     << "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n";
+
+  SmallVector<StringRef, 8> Skipped;
+  for (Function &F : M) {
+    if (F.isDeclaration() || !F.hasExternalLinkage())
+      continue;
+    const char *RetTy = getCTypeName(F.getReturnType());
+    bool Declarable = RetTy && isCIdentifier(F.getName());
+    for (auto &Arg : F.args())
+      Declarable = Declarable && getCTypeName(Arg.getType());
+    if (!Declarable) {
+      Skipped.push_back(F.getName());
+      continue;
+    }
+
+    OS << RetTy << ' ' << F.getName() << '(';
+    if (F.arg_empty())
+      OS << "void";
+    for (auto &Arg : F.args())
+      OS << (Arg.getArgNo() ? ", " : "") << getCTypeName(Arg.getType());
+    OS << ");\n";
+  }
+  if (!Skipped.empty()) {
+    OS << "\n/* Not callable from C:";
+    for (StringRef Name : Skipped)
+      OS << ' ' << Name;
+    OS << " */\n";
+  }
+
+  OS << "\n#ifdef __cplusplus\n}\n#endif\n\n#endif /* " << Guard << " */\n";
+  return true;
+}
+
+/// EmitObjectFile - Optimize the module holding the whole input and write it
+/// to the -emit-obj file, with its header.
+static bool EmitObjectFile() {
+  auto Start = Clock::now();
+  std::unique_ptr<TargetMachine> TM = createObjectTargetMachine();
+  if (!TM)
+    return false;
+  Module &M = *TheModule;
+  M.setDataLayout(TM->createDataLayout());
+  OptimizeModule(M, *TM);
+
+  std::error_code EC;
+  raw_fd_ostream OS(EmitObj, EC, sys::fs::F_None);
+  if (EC) {
+    fprintf(stderr, "Error: can't write '%s': %s\n", EmitObj.c_str(),
+            EC.message().c_str());
+    return false;
+  }
+  {
+    PhaseTimer Timer(PhaseJIT);
+    legacy::PassManager PM;
+    if (TM->addPassesToEmitFile(PM, OS, TargetMachine::CGFT_ObjectFile)) {
+      fprintf(stderr, "Error: the target can't emit object files\n");
+      return false;
+    }
+    PM.run(M);
+    OS.flush();
+  }
+
+  SmallString<128> HeaderPath(EmitObj);
+  sys::path::replace_extension(HeaderPath, "h");
+  if (!writeHeader(M, HeaderPath))
+    return false;
+
+  ++NumModules;
+  CompileSeconds += secondsSince(Start);
+  fprintf(stderr, "emit: %u definitions to %s, declared in %s\n",
+          NumDefinitions, EmitObj.c_str(), HeaderPath.c_str());
+  if (NumSkippedExprs)
+    fprintf(stderr, "emit: %u top-level expressions left out\n",
+            NumSkippedExprs);
+  return true;
+}
+
+//===----------------------------------------------------------------------===//
+// Interpreter tier
+//===----------------------------------------------------------------------===//
+
+// With -tiered, top-level expressions are evaluated straight off the AST, and
+// definitions wait in LazyDefinitions to be interpreted as well.  Once the
+// calls to a definition plus the trips round its loops reach -tier-threshold,
+// its next call compiles it (with whatever it calls), and from then on the
+// interpreter calls the native code.  The interpreter only knows doubles, so
+// anything that touches other values is compiled from the start.
+
+/// Compiled functions and externs are called through a function pointer of the
+/// right arity; definitions taking more arguments are never promoted, and
+/// stay interpreted should compiled code have made them compile anyway.
+static const unsigned MaxNativeCallArgs = 6;
+
+static DenseMap<SymbolID, void *> NativeFunctions;
+static bool EvalFailed;
+
+/// Tier accounting for -report-compile-time.
+static unsigned NumInterpretedExprs;
+static unsigned NumCompiledExprs;
+static unsigned NumPromotions;
+
+static double LogEvalError(const char *Str) {
+  LogError(Str);
+  EvalFailed = true;
+  return 0;
+}
+
+/// isTrue - The interpreter's version of 'fcmp one V, 0.0'.
+static bool isTrue(double V) { return V < 0.0 || V > 0.0; }
+
+/// PromoteToJIT - Compile a definition that got hot, together with the
+/// deferred definitions it calls.
+static bool PromoteToJIT(SymbolID Name) {
+  auto Start = Clock::now();
+  PendingDefinitions.push_back(Name);
+  bool Compiled = MaterializePendingDefinitions();
+  if (Compiled)
+    SubmitModule();
+  else
+    InitializeModuleAndPassManager();
+  CompileSeconds += secondsSince(Start);
+  ++NumPromotions;
+  return Compiled;
+}
+
+static void *getNativeFunction(SymbolID Name) {
+  auto I = NativeFunctions.find(Name);
+  if (I != NativeFunctions.end())
+    return I->second;
+
+  std::string FnName = Symbols.getName(Name).str();
+  void *Addr;
+  if (auto Sym = TheJIT->findSymbol(FnName))
+    Addr = (void *)(intptr_t)Sym.getAddress();
+  else
+    Addr = sys::DynamicLibrary::SearchForAddressOfSymbol(FnName);
+  if (Addr)
+    NativeFunctions[Name] = Addr;
+  return Addr;
+}
+
+/// findCompiledDefinition - The AST of the compiled definition of Name, if the
+/// interpreter can run it.
+static FunctionAST *findCompiledDefinition(SymbolID Name) {
+  auto II = InlinableDefinitions.find(Name);
+  if (II != InlinableDefinitions.end())
+    return II->second.get();
+  // The latest definition, should Name have been redefined.
+  for (auto &F : reverse(PromotedDefinitions))
+    if (F->getProto().getName() == Name)
+      return F.get();
+  return nullptr;
+}
+
+static double CallNative(void *Addr, ArrayRef<double> A) {
+  typedef double D;
+  switch (A.size()) {
+  case 0:
+    return ((D(*)())(intptr_t)Addr)();
+  case 1:
+    return ((D(*)(D))(intptr_t)Addr)(A[0]);
+  case 2:
+    return ((D(*)(D, D))(intptr_t)Addr)(A[0], A[1]);
+  case 3:
+    return ((D(*)(D, D, D))(intptr_t)Addr)(A[0], A[1], A[2]);
+  case 4:
+    return ((D(*)(D, D, D, D))(intptr_t)Addr)(A[0], A[1], A[2], A[3]);
+  case 5:
+    return ((D(*)(D, D, D, D, D))(intptr_t)Addr)(A[0], A[1], A[2], A[3],
+                                                   A[4]);
+  case 6:
+    return ((D(*)(D, D, D, D, D, D))(intptr_t)Addr)(A[0], A[1], A[2], A[3],
+                                                      A[4], A[5]);
+  }
+  return LogEvalError("Too many arguments for a call out of the interpreter");
+}
+
+/// CallFunction - Call Callee from interpreted code: interpret it if it is
+/// still cold, and call its native code otherwise.
+static double CallFunction(SymbolID Callee, ArrayRef<double> Args) {
+  auto LI = LazyDefinitions.find(Callee);
+  if (LI != LazyDefinitions.end()) {
+    FunctionAST &F = *LI->second;
+    if (F.getProto().getArgs().size() != Args.size())
+      return LogEvalError("Incorrect # arguments passed");
+    if (!F.usesTypedValues() &&
+        (F.addHeat(1) < TierThreshold || Args.size() > MaxNativeCallArgs))
+      return F.interpret(Args);
+    NativeFunctions.clear();
+    if (!PromoteToJIT(Callee)) {
+      EvalFailed = true;
+      return 0;
+    }
+  }
+
+  auto FI = FunctionProtos.find(Callee);
+  if (FI == FunctionProtos.end())
+    return LogEvalError("Unknown function referenced");
+  if (FI->second->getArgs().size() != Args.size())
+    return LogEvalError("Incorrect # arguments passed");
+  // Only a caller that knew Callee's prototype when it was parsed is compiled
+  // for it; the interpreter has nothing but doubles to pass.
+  if (FI->second->hasTypedValues())
+    return LogEvalError("A typed function must be defined before the "
+                        "interpreted code that calls it");
+  if (Args.size() > MaxNativeCallArgs)
+    if (FunctionAST *F = findCompiledDefinition(Callee))
+      if (!F->usesTypedValues())
+        return F->interpret(Args);
+
+  void *Addr = getNativeFunction(Callee);
+  if (!Addr)
+    return LogEvalError("Unresolved function");
+  return CallNative(Addr, Args);
+}
+
+double FunctionAST::interpret(ArrayRef<double> Args) {
+  // The same table as the compiled code's, so the tiers share results.
+  double Result;
+  if (Proto->isMemo() && getMemoTable().find(Args.data(), Result))
+    return Result;
+
+  EvalFrame Frame(this);
+  ArrayRef<SymbolID> Names = Proto->getArgs();
+  for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    Frame.Vars.push_back(std::make_pair(Names[i], Args[i]));
+  Result = Body->eval(Frame);
+
+  if (Proto->isMemo() && !EvalFailed)
+    getMemoTable().insert(Args.data(), Result);
+  return Result;
+}
+
+double NumberExprAST::eval(EvalFrame &Frame) { return Val; }
+
+double VariableExprAST::eval(EvalFrame &Frame) {
+  if (double *V = Frame.lookup(Name))
+    return *V;
+  return LogEvalError("Unknown variable name");
+}
+
+double ExprAST::evalAssign(EvalFrame &Frame, double Val) {
+  return LogEvalError("destination of '=' must be a variable");
+}
+
+double VariableExprAST::evalAssign(EvalFrame &Frame, double Val) {
+  double *Variable = Frame.lookup(Name);
+  if (!Variable)
+    return LogEvalError("Unknown variable name");
+  *Variable = Val;
+  return Val;
+}
 
-  return F;
+double UnaryExprAST::eval(EvalFrame &Frame) {
+  double OperandV = Operand->eval(Frame);
+  if (EvalFailed)
+    return 0;
+  return CallFunction(getOperatorID(false, Opcode), OperandV);
 }
 
-Function *FunctionAST::codegen() {
-  // Transfer ownership of the prototype to the FunctionProtos map, but keep a
-  // reference to it for use below.
-  auto &P = *Proto;
-  FunctionProtos[Proto->getName()] = std::move(Proto);
-  Function *TheFunction = getFunction(P.getName());
-  if (!TheFunction)
-    return nullptr;
+double BinaryExprAST::eval(EvalFrame &Frame) {
+  if (Op == '=') {
+    double Val = RHS->eval(Frame);
+    if (EvalFailed)
+      return 0;
+    return LHS->evalAssign(Frame, Val);
+  }
 
-  // If this is an operator, install it.
-  if (P.isBinaryOp())
-    BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+  double L = LHS->eval(Frame);
+  double R = RHS->eval(Frame);
+  if (EvalFailed)
+    return 0;
 
-  // Create a new basic block to start insertion into.
-  BasicBlock *BB = BasicBlock::Create(TheContext, "entry", TheFunction);
-  Builder.SetInsertPoint(BB);
+  switch (Op) {
+  case '+':
+    return L + R;
+  case '-':
+    return L - R;
+  case '*':
+    return L * R;
+  case '<':
+    return !(L >= R) ? 1.0 : 0.0; // fcmp ult
+  default:
+    break;
+  }
 
-  // Record the function arguments in the NamedValues map.
-  NamedValues.clear();
-  for (auto &Arg : TheFunction->args()) {
-    // Create an alloca for this variable.
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
+  double Ops[] = {L, R};
+  return CallFunction(getOperatorID(true, Op), Ops);
+}
 
-    // Store the initial value into the alloca.
-    Builder.CreateStore(&Arg, Alloca);
+double VectorExprAST::eval(EvalFrame &Frame) {
+  return LogEvalError("Only doubles can be interpreted");
+}
 
-    // Add arguments to variable symbol table.
-    NamedValues[Arg.getName()] = Alloca;
-  }
+double IntExprAST::eval(EvalFrame &Frame) {
+  return LogEvalError("Only doubles can be interpreted");
+}
 
-  if (Value *RetVal = Body->codegen()) {
-    // Finish off the function.
-    Builder.CreateRet(RetVal);
+double ArrayExprAST::eval(EvalFrame &Frame) {
+  return LogEvalError("Only doubles can be interpreted");
+}
 
-    // Validate the generated code, checking for consistency.
-    verifyFunction(*TheFunction);
+double LengthExprAST::eval(EvalFrame &Frame) {
+  return LogEvalError("Only doubles can be interpreted");
+}
 
-    // Run the optimizer on the function.
-    TheFPM->run(*TheFunction);
+double IndexExprAST::eval(EvalFrame &Frame) {
+  return LogEvalError("Only doubles can be interpreted");
+}
 
-    return TheFunction;
+double CallExprAST::eval(EvalFrame &Frame) {
+  SmallVector<double, 8> ArgsV;
+  for (ExprAST *Arg : Args) {
+    ArgsV.push_back(Arg->eval(Frame));
+    if (EvalFailed)
+      return 0;
   }
+  return CallFunction(Callee, ArgsV);
+}
 
-  // Error reading body, remove function.
-  TheFunction->eraseFromParent();
-
-  if (P.isBinaryOp())
-    BinopPrecedence.erase(Proto->getOperatorName());
-  return nullptr;
+double IfExprAST::eval(EvalFrame &Frame) {
+  double CondV = Cond->eval(Frame);
+  if (EvalFailed)
+    return 0;
+  return isTrue(CondV) ? Then->eval(Frame) : Else->eval(Frame);
 }
 
-//===----------------------------------------------------------------------===//
-// Top-Level parsing and JIT Driver
-//===----------------------------------------------------------------------===//
+double ForExprAST::eval(EvalFrame &Frame) {
+  double StartVal = Start->eval(Frame);
+  if (EvalFailed)
+    return 0;
 
-static void InitializeModuleAndPassManager() {
-  // Open a new module.
-  TheModule = llvm::make_unique<Module>("my cool jit", TheContext);
-  TheModule->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
+  // Same shape as the generated code: the body runs before the first test.
+  Frame.Vars.push_back(std::make_pair(VarName, StartVal));
+  size_t Slot = Frame.Vars.size() - 1;
+  while (true) {
+    // Every trip counts, so that a caller of this function sees it get hot
+    // while the loop still runs.
+    if (Frame.Fn)
+      Frame.Fn->addHeat(1);
+    Body->eval(Frame);
+    double StepVal = Step ? Step->eval(Frame) : 1.0;
+    double EndCond = End->eval(Frame);
+    if (EvalFailed)
+      break;
+    Frame.Vars[Slot].second += StepVal;
+    if (!isTrue(EndCond))
+      break;
+  }
+  Frame.Vars.pop_back();
+  return 0;
+}
 
-  // Create a new pass manager attached to it.
-  TheFPM = llvm::make_unique<legacy::FunctionPassManager>(TheModule.get());
+double ParForExprAST::eval(EvalFrame &Frame) {
+  double StartVal = Start->eval(Frame);
+  double EndVal = End->eval(Frame);
+  if (EvalFailed)
+    return 0;
+
+  // One iteration after another.  Like the compiled body's copies, the
+  // variables in scope are put back afterwards.
+  auto Saved = Frame.Vars;
+  Frame.Vars.push_back(std::make_pair(VarName, StartVal));
+  size_t Slot = Frame.Vars.size() - 1;
+  double Result = Reduce == '*' ? 1.0 : 0.0;
+  int64_t Trips = getParforTrips(StartVal, EndVal);
+  for (int64_t K = 0; K < Trips && !EvalFailed; ++K) {
+    if (Frame.Fn)
+      Frame.Fn->addHeat(1); // As in a for loop.
+    Frame.Vars[Slot].second = StartVal + K;
+    double BodyVal = Body->eval(Frame);
+    if (Reduce == '+')
+      Result += BodyVal;
+    else if (Reduce == '*')
+      Result *= BodyVal;
+  }
+  Frame.Vars = std::move(Saved);
+  return Reduce ? Result : 0;
+}
 
-  // Promote allocas to registers.
-  TheFPM->add(createPromoteMemoryToRegisterPass());
-  // Do simple "peephole" optimizations and bit-twiddling optzns.
-  TheFPM->add(createInstructionCombiningPass());
-  // Reassociate expressions.
-  TheFPM->add(createReassociatePass());
-  // Eliminate Common SubExpressions.
-  TheFPM->add(createGVNPass());
-  // Simplify the control flow graph (deleting unreachable blocks, etc).
-  TheFPM->add(createCFGSimplificationPass());
+double VarExprAST::eval(EvalFrame &Frame) {
+  // Each initializer is evaluated before its own variable is in scope.
+  for (auto &Var : VarNames) {
+    double InitVal = Var.second ? Var.second->eval(Frame) : 0.0;
+    if (EvalFailed)
+      return 0;
+    Frame.Vars.push_back(std::make_pair(Var.first, InitVal));
+  }
 
-  TheFPM->doInitialization();
+  double BodyVal = Body->eval(Frame);
+  Frame.Vars.resize(Frame.Vars.size() - VarNames.size());
+  return BodyVal;
+}
+
+/// InterpretTopLevelExpr - Run a top-level expression in the interpreter.
+static void InterpretTopLevelExpr(FunctionAST &FnAST) {
+  EvalFailed = false;
+  auto Start = Clock::now();
+  double Result = FnAST.interpret(None);
+  if (EvalFailed)
+    return;
+  recordExecution(secondsSince(Start));
+  ++NumInterpretedExprs;
+  if (EchoResults)
+    fprintf(stderr, "Evaluated to %f [interpreted]\n", Result);
 }
 
 static void HandleDefinition() {
   if (auto FnAST = ParseDefinition()) {
+    resetProfile(Symbols.getName(FnAST->getProto().getName()));
+    if (Lazy || Tiered) {
+      // Operators must be usable by the parser right away.
+      auto &P = FnAST->getProto();
+      if (P.isBinaryOp())
+        BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+      if (!Batch)
+        fprintf(stderr, "Read function definition: %s (%s)\n",
+                Symbols.getName(P.getName()).str().c_str(),
+                Tiered ? "interpreted until hot" : "compiled on first use");
+      // A redefinition: getFunction() must not find the compiled version,
+      // or a copy of its body, before this one.
+      InlinableDefinitions.erase(P.getName());
+      FunctionProtos.erase(P.getName());
+      LazyDefinitions[P.getName()] = std::move(FnAST);
+      return;
+    }
+
+    auto Start = Clock::now();
     if (auto *FnIR = FnAST->codegen()) {
-      fprintf(stderr, "Read function definition:");
-      FnIR->print(errs());
-      fprintf(stderr, "\n");
-      TheJIT->addModule(std::move(TheModule));
-      InitializeModuleAndPassManager();
+      ++NumDefinitions;
+      if (Batch) {
+        if (++BatchModuleDefinitions == BatchChunkSize)
+          FlushBatchModule();
+      } else {
+        fprintf(stderr, "Read function definition:");
+        FnIR->print(errs());
+        fprintf(stderr, "\n");
+        SubmitModule();
+      }
+      if (isInlinable(*FnAST))
+        InlinableDefinitions[FnAST->getProto().getName()] = std::move(FnAST);
     }
+    CompileSeconds += secondsSince(Start);
   } else {
     // Skip token for error recovery.
     getNextToken();
@@ -1147,9 +4577,11 @@ static void HandleDefinition() {
 static void HandleExtern() {
   if (auto ProtoAST = ParseExtern()) {
     if (auto *FnIR = ProtoAST->codegen()) {
-      fprintf(stderr, "Read extern: ");
-      FnIR->print(errs());
-      fprintf(stderr, "\n");
+      if (!Batch) {
+        fprintf(stderr, "Read extern: ");
+        FnIR->print(errs());
+        fprintf(stderr, "\n");
+      }
       FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
     }
   } else {
@@ -1161,24 +4593,82 @@ static void HandleExtern() {
 static void HandleTopLevelExpression() {
   // Evaluate a top-level expression into an anonymous function.
   if (auto FnAST = ParseTopLevelExpr()) {
-    if (FnAST->codegen()) {
-      // JIT the module containing the anonymous expression, keeping a handle so
-      // we can free it later.
-      auto H = TheJIT->addModule(std::move(TheModule));
-      InitializeModuleAndPassManager();
-
-      // Search the JIT for the __anon_expr symbol.
-      auto ExprSymbol = TheJIT->findSymbol("__anon_expr");
-      assert(ExprSymbol && "Function not found");
-
-      // Get the symbol's address and cast it to the right type (takes no
-      // arguments, returns a double) so we can call it as a native function.
-      double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
-      fprintf(stderr, "Evaluated to %f\n", FP());
-
-      // Delete the anonymous expression module from the JIT.
-      TheJIT->removeModule(H);
+    if (Tiered && !Batch && !FnAST->hasLoop() && !FnAST->usesTypedValues()) {
+      InterpretTopLevelExpr(*FnAST);
+      return;
+    }
+
+    // An object file only holds the definitions.
+    if (!EmitObj.empty()) {
+      ++NumSkippedExprs;
+      return;
+    }
+
+    auto Start = Clock::now();
+    if (Batch) {
+      if (auto *FnIR = FnAST->codegen()) {
+        // Give the expression a name of its own so the module can hold many;
+        // it runs once the whole input has been compiled.
+        FnIR->setName("__anon_expr." + Twine(NumBatchExprs++));
+        BatchExprs.push_back(FnIR->getName().str());
+      }
+      CompileSeconds += secondsSince(Start);
+      return;
+    }
+
+    // Generate and optimize the expression in the slot module.
+    SwapExprSlot();
+    Function *FnIR = FnAST->codegen();
+    if (FnIR && optimizeWholeModules()) {
+      PhaseTimer Timer(PhaseOptimize);
+      uint64_t Before = countInstructions(*TheModule);
+      TheFPM->run(*FnIR);
+      TheExprSlot.MPM->run(*TheModule);
+      recordOptimization(Before, countInstructions(*TheModule));
+    }
+    SwapExprSlot();
+    if (!FnIR) {
+      ClearExprSlot();
+      return;
+    }
+
+    // Compile the deferred definitions the expression uses into a module of
+    // their own, which stays in the JIT after the expression is freed.
+    if (!PendingDefinitions.empty()) {
+      if (MaterializePendingDefinitions()) {
+        SubmitModule();
+      } else {
+        InitializeModuleAndPassManager();
+        ClearExprSlot();
+        return;
+      }
     }
+
+    // JIT the anonymous expression, keeping a handle so we can free it later.
+    // It is needed right away, so compile it here while any earlier modules
+    // finish on the compile threads.  Once compiled, its IR can go.
+    auto JITStart = Clock::now();
+    auto H = TheJIT->addTransientModule(*TheExprSlot.M);
+    ClearExprSlot();
+
+    // Search the expression's own object for the __anon_expr symbol.
+    auto ExprSymbol = TheJIT->findSymbolIn(H, "__anon_expr");
+    assert(ExprSymbol && "Function not found");
+    addPhaseTime(PhaseJIT, secondsSince(JITStart));
+
+    // Get the symbol's address and cast it to the right type (takes no
+    // arguments, returns a double) so we can call it as a native function.
+    double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
+    CompileSeconds += secondsSince(Start);
+    ++NumCompiledExprs;
+    auto RunStart = Clock::now();
+    double Result = FP();
+    recordExecution(secondsSince(RunStart));
+    if (EchoResults)
+      fprintf(stderr, "Evaluated to %f%s\n", Result, Tiered ? " [jit]" : "");
+
+    // Delete the anonymous expression's code from the JIT.
+    TheJIT->removeModule(H);
   } else {
     // Skip token for error recovery.
     getNextToken();
@@ -1188,7 +4678,8 @@ static void HandleTopLevelExpression() {
 /// top ::= definition | external | expression | ';'
 static void MainLoop() {
   while (true) {
-    fprintf(stderr, "ready> ");
+    if (!Batch)
+      fprintf(stderr, "ready> ");
     switch (CurTok) {
     case tok_eof:
       return;
@@ -1230,14 +4721,757 @@ extern "C" DLLEXPORT double printd(double X) {
   return 0;
 }
 
+/// The seconds each benchstop() measured, in order.
+static std::vector<double> BenchSeconds;
+static Clock::time_point BenchStart;
+
+/// benchstart, benchstop - Bracket the part of a generated -bench program
+/// that is measured, leaving out compiling it and setting up its data.
+extern "C" DLLEXPORT double benchstart() {
+  BenchStart = Clock::now();
+  return 0;
+}
+
+extern "C" DLLEXPORT double benchstop() {
+  BenchSeconds.push_back(secondsSince(BenchStart));
+  return 0;
+}
+
+/// KArray - What an array value points to.  Compiled code reads both fields
+/// directly and assumes they never change, so C code can hand Kaleidoscope
+/// functions a buffer of its own by wrapping it with kaleidoscope_array_wrap.
+struct KArray {
+  double *Data;
+  int64_t Length;
+};
+
+/// kaleidoscope_array_new - array(n): Length zeroed doubles.  Arrays live until
+/// the program exits.  Stops the program if there is not enough memory.
+extern "C" DLLEXPORT KArray *kaleidoscope_array_new(int64_t Length) {
+  if (Length < 0)
+    Length = 0;
+  double *Data = (double *)calloc(Length ? Length : 1, sizeof(double));
+  if (!Data) {
+    fprintf(stderr, "Error: out of memory for an array of %lld\n",
+            (long long)Length);
+    exit(1);
+  }
+  KArray *A = new KArray;
+  A->Data = Data;
+  A->Length = Length;
+  return A;
+}
+
+/// kaleidoscope_array_wrap - An array of the Length doubles at Data, which
+/// stay owned by the caller.
+extern "C" DLLEXPORT KArray *kaleidoscope_array_wrap(double *Data,
+                                                     int64_t Length) {
+  KArray *A = new KArray;
+  A->Data = Data;
+  A->Length = Length;
+  return A;
+}
+
+/// kaleidoscope_array_bounds - Called by compiled code for an index outside
+/// an array.  Does not return.
+extern "C" DLLEXPORT void kaleidoscope_array_bounds(int64_t Index,
+                                                    int64_t Length) {
+  fprintf(stderr, "Error: index %lld is out of bounds for an array of %lld\n",
+          (long long)Index, (long long)Length);
+  exit(1);
+}
+
+/// kaleidoscope_memo_find - Called by a compiled memo function on entry: set
+/// *Result to the result remembered for Args, if there is one.
+extern "C" DLLEXPORT bool kaleidoscope_memo_find(MemoTable *Table,
+                                                 const double *Args,
+                                                 double *Result) {
+  return Table->find(Args, *Result);
+}
+
+/// kaleidoscope_memo_insert - Called by a compiled memo function with the
+/// result it computed.
+extern "C" DLLEXPORT void kaleidoscope_memo_insert(MemoTable *Table,
+                                                   const double *Args,
+                                                   double Result) {
+  Table->insert(Args, Result);
+}
+
+/// ParforBody - A parfor body as ParForExprAST::codegen outlines it: runs the
+/// iterations [Begin, End) with the variables packed in Env and returns their
+/// reduction.
+typedef double (*ParforBody)(void *Env, int64_t Begin, int64_t End);
+
+/// A loop is cut into at most this many chunks, whatever the thread count.
+static const int64_t ParforMaxChunks = 1024;
+
+/// The most threads a pool is made with, whatever -parfor-threads or
+/// parforthreads() ask for.
+static const unsigned ParforMaxThreads = 256;
+
+/// Set on the pool's threads, and on the one running a loop while it helps;
+/// a parfor inside a parfor body runs on the thread that reaches it.
+static thread_local bool InParforBody = false;
+
+namespace {
+
+/// ParforPool - The threads parfor loops run on, with work stealing.  Each
+/// thread starts with an even share of a loop's chunks and runs them from the
+/// front; once its share is gone it takes the back half of another thread's,
+/// so threads that finish early take on the work of slow ones.  Every chunk
+/// stores its result in a slot of its own and the slots are reduced in
+/// order, so a reduction comes out the same on any number of threads.
+class ParforPool {
+  /// WorkRange - The chunks [Next, End) a thread has yet to run.
+  struct WorkRange {
+    std::mutex Mutex;
+    int64_t Next = 0, End = 0;
+  };
+
+  struct Loop {
+    ParforBody Body;
+    void *Env;
+    int64_t Trips, ChunkSize;
+    double *Results;
+  };
+
+  unsigned NumWorkers; // Including the thread running the loop.
+  std::unique_ptr<WorkRange[]> Ranges;
+  std::vector<std::thread> Threads;
+
+  std::mutex Mutex;
+  std::condition_variable WakeUp, Finished;
+  const Loop *Current = nullptr;
+  uint64_t Generation = 0; // Bumped for each loop.
+  unsigned Busy = 0;       // Pool threads working on Current.
+  bool ShuttingDown = false;
+
+  bool takeChunk(WorkRange &R, int64_t &Chunk) {
+    std::lock_guard<std::mutex> Lock(R.Mutex);
+    if (R.Next == R.End)
+      return false;
+    Chunk = R.Next++;
+    return true;
+  }
+
+  /// steal - Move the back half of some other thread's chunks to Self's,
+  /// which is empty.  False if every thread is out of chunks.
+  bool steal(unsigned Self) {
+    for (unsigned i = 1; i != NumWorkers; ++i) {
+      WorkRange &Victim = Ranges[(Self + i) % NumWorkers];
+      int64_t Begin, End;
+      {
+        std::lock_guard<std::mutex> Lock(Victim.Mutex);
+        int64_t Left = Victim.End - Victim.Next;
+        if (!Left)
+          continue;
+        End = Victim.End;
+        Begin = End - (Left + 1) / 2;
+        Victim.End = Begin;
+      }
+      std::lock_guard<std::mutex> Lock(Ranges[Self].Mutex);
+      Ranges[Self].Next = Begin;
+      Ranges[Self].End = End;
+      return true;
+    }
+    return false;
+  }
+
+  void runChunks(unsigned Self, const Loop &L) {
+    do {
+      int64_t Chunk;
+      while (takeChunk(Ranges[Self], Chunk)) {
+        int64_t Begin = Chunk * L.ChunkSize;
+        L.Results[Chunk] =
+            L.Body(L.Env, Begin, std::min(L.Trips, Begin + L.ChunkSize));
+      }
+    } while (steal(Self));
+  }
+
+  void workerMain(unsigned Self) {
+    InParforBody = true;
+    uint64_t Seen = 0;
+    std::unique_lock<std::mutex> Lock(Mutex);
+    while (true) {
+      WakeUp.wait(Lock, [&] { return ShuttingDown || Generation != Seen; });
+      if (ShuttingDown)
+        return;
+      Seen = Generation;
+      // Woken too late: the loop is over already.
+      if (!Current)
+        continue;
+      const Loop &L = *Current;
+      ++Busy;
+      Lock.unlock();
+      runChunks(Self, L);
+      Lock.lock();
+      if (--Busy == 0)
+        Finished.notify_one();
+    }
+  }
+
+public:
+  explicit ParforPool(unsigned NumThreads)
+      : NumWorkers(std::max(NumThreads, 1u)),
+        Ranges(new WorkRange[NumWorkers]) {
+    for (unsigned i = 1; i != NumWorkers; ++i)
+      Threads.emplace_back(&ParforPool::workerMain, this, i);
+  }
+
+  ~ParforPool() {
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      ShuttingDown = true;
+    }
+    WakeUp.notify_all();
+    for (std::thread &T : Threads)
+      T.join();
+  }
+
+  unsigned getNumThreads() const { return NumWorkers; }
+
+  /// run - Run Trips iterations of Body, and reduce the results of its
+  /// chunks with Reduce, which is '+', '*', or 0 for none.
+  double run(ParforBody Body, void *Env, int64_t Trips, char Reduce) {
+    double Result = Reduce == '*' ? 1.0 : 0.0;
+    if (Trips <= 0)
+      return Result;
+
+    Loop L;
+    L.Body = Body;
+    L.Env = Env;
+    L.Trips = Trips;
+    L.ChunkSize = (Trips + ParforMaxChunks - 1) / ParforMaxChunks;
+    int64_t NumChunks = (Trips + L.ChunkSize - 1) / L.ChunkSize;
+    std::vector<double> Results(NumChunks);
+    L.Results = Results.data();
+
+    if (InParforBody || NumWorkers == 1) {
+      for (int64_t Chunk = 0; Chunk != NumChunks; ++Chunk) {
+        int64_t Begin = Chunk * L.ChunkSize;
+        Results[Chunk] = Body(Env, Begin, std::min(Trips, Begin + L.ChunkSize));
+      }
+    } else {
+      // No pool thread touches the ranges between loops.
+      for (unsigned i = 0; i != NumWorkers; ++i) {
+        Ranges[i].Next = NumChunks * i / NumWorkers;
+        Ranges[i].End = NumChunks * (i + 1) / NumWorkers;
+      }
+      {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        Current = &L;
+        ++Generation;
+      }
+      WakeUp.notify_all();
+
+      InParforBody = true;
+      runChunks(0, L);
+      InParforBody = false;
+
+      // Every chunk has been taken; wait for the ones still running.
+      std::unique_lock<std::mutex> Lock(Mutex);
+      Finished.wait(Lock, [&] { return Busy == 0; });
+      Current = nullptr;
+    }
+
+    if (Reduce == '+')
+      for (double R : Results)
+        Result += R;
+    else if (Reduce == '*')
+      for (double R : Results)
+        Result *= R;
+    return Result;
+  }
+};
+
+} // end anonymous namespace
+
+/// The pool, made on first use.  It is never destroyed: a body may call exit()
+/// on one of its threads, which could not join itself.
+static ParforPool *TheParforPool = nullptr;
+
+static ParforPool &getParforPool() {
+  if (!TheParforPool)
+    TheParforPool = new ParforPool(
+        std::min(ParforThreads ? ParforThreads
+                               : std::thread::hardware_concurrency(),
+                 ParforMaxThreads));
+  return *TheParforPool;
+}
+
+/// kaleidoscope_parfor - Called by compiled code to run a parfor loop: Trips
+/// iterations of Body, whose results are combined with Reduce.
+extern "C" DLLEXPORT double kaleidoscope_parfor(ParforBody Body, void *Env,
+                                                int64_t Trips, int32_t Reduce) {
+  return getParforPool().run(Body, Env, Trips, (char)Reduce);
+}
+
+/// parforthreads - Run parfor loops on N threads from now on, or one per core
+/// if N is 0.  Returns the previous count.  Does nothing inside a parfor body,
+/// or for a negative or NaN N; an N above ParforMaxThreads gets that many.
+extern "C" DLLEXPORT double parforthreads(double N) {
+  unsigned Old = getParforPool().getNumThreads();
+  if (InParforBody || !(N >= 0))
+    return Old;
+  ParforThreads = (unsigned)std::min(N, (double)ParforMaxThreads);
+  delete TheParforPool;
+  TheParforPool = nullptr;
+  getParforPool();
+  return Old;
+}
+
+//===----------------------------------------------------------------------===//
+// Benchmarks
+//===----------------------------------------------------------------------===//
+
+/// generateBenchProgram - Build a synthetic program of at least SizeMB
+/// megabytes by numbering copies of a small set of definitions.
+static std::unique_ptr<MemoryBuffer> generateBenchProgram(unsigned SizeMB) {
+  std::string Text;
+  size_t Target = (size_t)SizeMB << 20;
+  Text.reserve(Target + 256);
+  for (unsigned I = 0; Text.size() < Target; ++I) {
+    std::string N = std::to_string(I);
+    Text += "# helper group " + N + "\n";
+    Text += "def fib" + N + "(x)\n  if x < 3 then 1 else fib" + N +
+            "(x-1) + fib" + N + "(x-2);\n";
+    Text += "def sum" + N + "(n) var acc = 0 in (for i = 1, i < n, 1.0 in " +
+            "acc = acc + i * 0.5) + acc;\n";
+    Text += "sum" + N + "(100) + fib" + N + "(" + std::to_string(I % 20) +
+            ");\n";
+  }
+  return MemoryBuffer::getMemBufferCopy(Text, "<generated>");
+}
+
+/// OpenBenchInput - Load the input file, or generate one if none was given.
+static bool OpenBenchInput() {
+  if (InputFilename != "-")
+    return Source.open(InputFilename);
+  Source.setBuffer(generateBenchProgram(BenchSize));
+  return true;
+}
+
+/// RunLexBench - Tokenize the whole input and report the throughput.
+static void RunLexBench() {
+  if (!OpenBenchInput())
+    return;
+
+  // Time the tokenizing only, not loading the input.
+  uint64_t Tokens = 0;
+  auto Start = Clock::now();
+  while (gettok() != tok_eof)
+    ++Tokens;
+  double Secs = secondsSince(Start);
+
+  uint64_t InputBytes = Source.getBufferSize();
+  fprintf(stderr, "lex: %llu bytes, %llu tokens in %.3f s: %.1f MB/s\n",
+          (unsigned long long)InputBytes, (unsigned long long)Tokens, Secs,
+          InputBytes / Secs / (1 << 20));
+}
+
+/// RunParseBench - Parse the whole input without generating code and report
+/// the throughput and how much the AST allocated.
+static void RunParseBench() {
+  if (!OpenBenchInput())
+    return;
+
+  uint64_t Items = 0;
+  auto Start = Clock::now();
+  getNextToken();
+  while (CurTok != tok_eof) {
+    switch (CurTok) {
+    case ';':
+      getNextToken();
+      continue;
+    case tok_def:
+      if (auto FnAST = ParseDefinition()) {
+        // Later items may use the operator.
+        auto &P = FnAST->getProto();
+        if (P.isBinaryOp())
+          BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+        ++Items;
+        continue;
+      }
+      break;
+    case tok_extern:
+      if (ParseExtern()) {
+        ++Items;
+        continue;
+      }
+      break;
+    default:
+      if (ParseTopLevelExpr()) {
+        ++Items;
+        continue;
+      }
+      break;
+    }
+    // Skip token for error recovery.
+    getNextToken();
+  }
+  double Secs = secondsSince(Start);
+
+  uint64_t InputBytes = Source.getBufferSize();
+  fprintf(stderr, "parse: %llu bytes, %llu items in %.3f s: %.1f MB/s\n",
+          (unsigned long long)InputBytes, (unsigned long long)Items, Secs,
+          InputBytes / Secs / (1 << 20));
+  fprintf(stderr, "parse: %llu AST nodes, %.1f bytes/node, %llu arena "
+                  "bytes per item\n",
+          (unsigned long long)NumASTNodes,
+          NumASTNodes ? (double)NumASTArenaBytes / NumASTNodes : 0.0,
+          (unsigned long long)(Items ? NumASTArenaBytes / Items : 0));
+  fprintf(stderr, "parse: %llu AST nodes removed by simplification\n",
+          (unsigned long long)NumSimplifiedNodes);
+}
+
+/// generateReplBenchProgram - A few definitions followed by Lines short
+/// expressions of the kind typed at the REPL.
+static std::unique_ptr<MemoryBuffer> generateReplBenchProgram(unsigned Lines) {
+  std::string Text = "def fib(x) if x < 3 then 1 else fib(x-1)+fib(x-2);\n"
+                     "def avg(a b) (a + b) * 0.5;\n"
+                     "def poly(x) x * x * 3 + x * 2 + 1;\n";
+  for (unsigned I = 0; I != Lines; ++I) {
+    std::string N = std::to_string(I);
+    switch (I % 4) {
+    case 0:
+      Text += "fib(" + std::to_string(I % 12) + ") + " + N + ";\n";
+      break;
+    case 1:
+      Text += "avg(" + N + ", " + std::to_string(I * 2) + ") - poly(" + N +
+              ");\n";
+      break;
+    case 2:
+      Text += "var a = " + N + " in a * a + 1;\n";
+      break;
+    case 3:
+      Text += N + " * 0.5 + 3 < " + N + ";\n";
+      break;
+    }
+  }
+  return MemoryBuffer::getMemBufferCopy(Text, "<generated>");
+}
+
+/// TimeTopLevelExprs - Handle the input like the REPL does, and return how
+/// long each top-level expression took from parse to result.
+static std::vector<double> TimeTopLevelExprs() {
+  std::vector<double> Latencies;
+  while (CurTok != tok_eof) {
+    switch (CurTok) {
+    case ';':
+      getNextToken();
+      break;
+    case tok_def:
+      HandleDefinition();
+      break;
+    case tok_extern:
+      HandleExtern();
+      break;
+    default: {
+      auto Start = Clock::now();
+      HandleTopLevelExpression();
+      Latencies.push_back(secondsSince(Start));
+      break;
+    }
+    }
+  }
+  return Latencies;
+}
+
+/// RunReplBench - Report the latency of each evaluated line.
+static void RunReplBench() {
+  EchoResults = false;
+  std::vector<double> Latencies = TimeTopLevelExprs();
+  EchoResults = true;
+  if (Latencies.empty())
+    return;
+
+  double Total = 0;
+  for (double L : Latencies)
+    Total += L;
+  std::sort(Latencies.begin(), Latencies.end());
+  size_t N = Latencies.size();
+  fprintf(stderr,
+          "repl: %u expressions, p50 %.1f us, p99 %.1f us, mean %.1f us\n",
+          (unsigned)N, Latencies[N / 2] * 1e6, Latencies[N * 99 / 100] * 1e6,
+          Total / N * 1e6);
+}
+
+/// The kernels -bench=arrays times, one top-level expression each.
+static const char *const ArrayBenchKernels[] = {"scale", "saxpy", "sum"};
+static const unsigned ArrayBenchPasses = 100;
+
+/// generateArrayBenchProgram - Array kernels written as plain 'for' loops,
+/// and for each one an expression running it ArrayBenchPasses times over
+/// arrays of Elements doubles.
+static std::unique_ptr<MemoryBuffer>
+generateArrayBenchProgram(unsigned Elements) {
+  std::string Text =
+      "def binary : 1 (x y) y;\n"
+      "def fill(a:array) for i = int(0), i < len(a) - 1 in a[i] = i;\n"
+      "def scale(y:array x:array) for i = int(0), i < len(y) - 1 in "
+      "y[i] = x[i] * 3;\n"
+      "def saxpy(y:array x:array) for i = int(0), i < len(y) - 1 in "
+      "y[i] = y[i] + x[i] * 0.5;\n"
+      "def sum(y:array x:array) var t = 0 in "
+      "(for i = int(0), i < len(x) - 1 in t = t + x[i]) : (y[0] = t);\n";
+  std::string N = std::to_string(Elements);
+  std::string Passes = std::to_string(ArrayBenchPasses - 1);
+  for (const char *Kernel : ArrayBenchKernels)
+    Text += "var x = array(" + N + "), y = array(" + N + ") in fill(x) : " +
+            "(for r = 0, r < " + Passes + " in " + Kernel + "(y, x)) : y[0];\n";
+  return MemoryBuffer::getMemBufferCopy(Text, "<generated>");
+}
+
+/// RunArrayBench - Time each array kernel, compile time included.  The loop
+/// vectorizer's -pass-remarks show which loops it took.
+static void RunArrayBench() {
+  std::vector<double> Times = TimeTopLevelExprs();
+  double Elements = (double)BenchElements * ArrayBenchPasses;
+  for (unsigned i = 0, e = std::min(Times.size(), array_lengthof(ArrayBenchKernels));
+       i != e; ++i)
+    fprintf(stderr,
+            "arrays: %-5s %u elements x %u passes in %.3f s: %.1f M elements/s\n",
+            ArrayBenchKernels[i], (unsigned)BenchElements, ArrayBenchPasses,
+            Times[i], Elements / Times[i] / 1e6);
+}
+
+/// generateTailCallBenchProgram - Count to Depth by recursion with an
+/// accumulator, then with a 'for' loop.  Without tail calls the recursion needs
+/// a stack frame per step and overflows long before 10^7.
+static std::unique_ptr<MemoryBuffer>
+generateTailCallBenchProgram(unsigned Depth) {
+  std::string N = std::to_string(Depth);
+  std::string Text =
+      "def binary : 1 (x y) y;\n"
+      "def count(n acc) if n < 1 then acc else count(n - 1, acc + 1);\n"
+      "def countloop(n) var acc = 0 in "
+      "(for i = 1, i < n in acc = acc + 1) : acc;\n"
+      "count(" + N + ", 0);\n"
+      "countloop(" + N + ");\n";
+  return MemoryBuffer::getMemBufferCopy(Text, "<generated>");
+}
+
+/// RunTailCallBench - Time the recursion and the loop, compile time included.
+static void RunTailCallBench() {
+  static const char *const Kinds[] = {"recursion", "loop"};
+  std::vector<double> Times = TimeTopLevelExprs();
+  for (unsigned i = 0, e = std::min(Times.size(), array_lengthof(Kinds));
+       i != e; ++i)
+    fprintf(stderr, "tailcalls: %-9s to %u in %.3f s: %.1f M steps/s\n",
+            Kinds[i], (unsigned)BenchDepth, Times[i],
+            BenchDepth / Times[i] / 1e6);
+}
+
+/// generateOperatorBenchProgram - The same sum written with the built-in '+'
+/// and '-', and with user-defined operators that do the same.
+static std::unique_ptr<MemoryBuffer>
+generateOperatorBenchProgram(unsigned Trips) {
+  std::string N = std::to_string(Trips);
+  std::string Text =
+      "def binary : 1 (x y) y;\n"
+      "def binary ^ 20 (a b) a + b;\n"
+      "def unary ~ (v) 0 - v;\n"
+      "def sumbuiltin(n) var s = 0 in "
+      "(for i = 0, i < n in s = s + (0 - i * 0.5)) : s;\n"
+      "def sumoperators(n) var s = 0 in "
+      "(for i = 0, i < n in s = s ^ ~(i * 0.5)) : s;\n"
+      "sumbuiltin(" + N + ");\n"
+      "sumoperators(" + N + ");\n";
+  return MemoryBuffer::getMemBufferCopy(Text, "<generated>");
+}
+
+/// RunOperatorBench - Time both loops, compile time included.
+static void RunOperatorBench() {
+  static const char *const Kinds[] = {"built-in", "user-defined"};
+  std::vector<double> Times = TimeTopLevelExprs();
+  for (unsigned i = 0, e = std::min(Times.size(), array_lengthof(Kinds));
+       i != e; ++i)
+    fprintf(stderr, "operators: %-12s %u trips in %.3f s: %.1f M trips/s\n",
+            Kinds[i], (unsigned)BenchTrips, Times[i],
+            BenchTrips / Times[i] / 1e6);
+}
+
+/// The thread counts -bench=parfor tries, one top-level expression each.
+static const unsigned ParforBenchThreads[] = {1, 2, 4, 8, 16};
+static const unsigned ParforBenchTrips = 1 << 16;
+
+/// generateParforBenchProgram - A parfor loop whose iterations each run a
+/// short serial recurrence, i.e. embarrassingly parallel work, summed up.
+static std::unique_ptr<MemoryBuffer> generateParforBenchProgram() {
+  std::string Text =
+      "def binary : 1 (x y) y;\n"
+      "extern parforthreads(n);\n"
+      "def work(i) var x = i * 0.00001 in "
+      "(for j = 0, j < 1000 in x = x * x * 0.25 + 0.5) : x;\n"
+      "def total(n) parfor i = 0, n reduce + in work(i);\n";
+  for (unsigned Threads : ParforBenchThreads)
+    Text += "parforthreads(" + std::to_string(Threads) + ") : total(" +
+            std::to_string(ParforBenchTrips) + ");\n";
+  return MemoryBuffer::getMemBufferCopy(Text, "<generated>");
+}
+
+/// RunParforBench - Time the loop at each thread count, against one thread.
+static void RunParforBench() {
+  std::vector<double> Times = TimeTopLevelExprs();
+  for (unsigned i = 0,
+                e = std::min(Times.size(), array_lengthof(ParforBenchThreads));
+       i != e; ++i)
+    fprintf(stderr, "parfor: %2u threads, %u trips in %.3f s: %.2fx\n",
+            ParforBenchThreads[i], ParforBenchTrips, Times[i],
+            Times[0] / Times[i]);
+}
+
+/// The kernels -bench=fastmath times, each defined strict and 'fastmath'.
+static const char *const FastMathBenchKernels[] = {"dot", "poly"};
+
+/// generateFastMathBenchProgram - A dot product, a reduction the vectorizer
+/// may only reorder under fast math, and a polynomial in Horner form, which
+/// fast math contracts into FMAs.  Each kernel is run ArrayBenchPasses times
+/// over arrays of Elements doubles, strict first and then 'fastmath'.
+static std::unique_ptr<MemoryBuffer>
+generateFastMathBenchProgram(unsigned Elements) {
+  static const char *const Bodies[] = {
+      "(a:array b:array) var s = 0 in "
+      "(for i = int(0), i < len(a) - 1 in s = s + a[i] * b[i]) : s;\n",
+      "(a:array b:array) var s = 0 in "
+      "(for i = int(0), i < len(a) - 1 in "
+      "(var x = a[i] in s = s + (((x * 0.5 + b[i]) * x + 0.25) * x + 0.125) "
+      "* x + 1)) : s;\n"};
+  std::string Text =
+      "def binary : 1 (x y) y;\n"
+      "extern benchstart();\n"
+      "extern benchstop();\n"
+      "def fill(a:array) for i = 0, i < len(a) - 1 in a[i] = i * 0.000001;\n";
+  for (unsigned i = 0; i != array_lengthof(FastMathBenchKernels); ++i) {
+    Text += "def " + std::string(FastMathBenchKernels[i]) + Bodies[i];
+    Text += "def fastmath fast" + std::string(FastMathBenchKernels[i]) +
+            Bodies[i];
+  }
+
+  std::string N = std::to_string(Elements);
+  std::string Passes = std::to_string(ArrayBenchPasses - 1);
+  for (const char *Kernel : FastMathBenchKernels)
+    for (const char *Prefix : {"", "fast"})
+      Text += "var x = array(" + N + "), y = array(" + N +
+              "), t = 0 in fill(x) : fill(y) : benchstart() : (for r = 0, r < " +
+              Passes + " in t = t + " + Prefix + Kernel +
+              "(x, y)) : benchstop() : t;\n";
+  return MemoryBuffer::getMemBufferCopy(Text, "<generated>");
+}
+
+/// RunFastMathBench - Time each kernel strict and with fast math.  Only the
+/// passes over the arrays are timed, not compiling the expression or filling
+/// the arrays.  Fast math only pays off with an -O level, which runs the
+/// vectorizer.
+static void RunFastMathBench() {
+  TimeTopLevelExprs();
+  const std::vector<double> &Times = BenchSeconds;
+  double Elements = (double)BenchElements * ArrayBenchPasses;
+  for (unsigned i = 0;
+       i != array_lengthof(FastMathBenchKernels) && 2 * i + 1 < Times.size();
+       ++i) {
+    double Strict = Times[2 * i], Fast = Times[2 * i + 1];
+    fprintf(stderr,
+            "fastmath: %-4s strict %.3f s (%.1f M elements/s), fastmath "
+            "%.3f s (%.1f M elements/s): %.2fx\n",
+            FastMathBenchKernels[i], Strict, Elements / Strict / 1e6, Fast,
+            Elements / Fast / 1e6, Strict / Fast);
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Time report
+//===----------------------------------------------------------------------===//
+
+/// getPeakRSS - The most memory the process has had resident, in kilobytes,
+/// or 0 where that is not known.
+static uint64_t getPeakRSS() {
+#ifdef LLVM_ON_WIN32
+  return 0;
+#else
+  struct rusage Usage;
+  if (getrusage(RUSAGE_SELF, &Usage))
+    return 0;
+#ifdef __APPLE__
+  return Usage.ru_maxrss / 1024; // In bytes there.
+#else
+  return Usage.ru_maxrss;
+#endif
+#endif
+}
+
+/// PrintTimeReport - The -time-report summary, on stderr.
+static void PrintTimeReport() {
+  fprintf(stderr, "time: %-10s %10s %8s\n", "phase", "wall ms", "runs");
+  for (unsigned P = 0; P != NumPhases; ++P)
+    fprintf(stderr, "time: %-10s %10.1f %8llu\n", PhaseNames[P],
+            Phases[P].Seconds * 1000, (unsigned long long)Phases[P].Count);
+  fprintf(stderr,
+          "time: %llu tokens, %llu AST nodes, %llu IR instructions "
+          "optimized into %llu, %u modules\n",
+          (unsigned long long)NumTokens, (unsigned long long)NumASTNodes,
+          (unsigned long long)NumInstsBeforeOpt,
+          (unsigned long long)NumInstsAfterOpt, NumModules);
+  fprintf(stderr, "time: peak RSS %llu KB\n",
+          (unsigned long long)getPeakRSS());
+}
+
+/// WriteTimeReportJSON - The -time-report figures as a JSON object, for
+/// tools that track them from run to run.
+static void WriteTimeReportJSON(StringRef Path) {
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::F_Text);
+  if (EC) {
+    fprintf(stderr, "Error: can't write '%s': %s\n", Path.str().c_str(),
+            EC.message().c_str());
+    return;
+  }
+
+  OS << "{\n  \"phases\": {\n";
+  for (unsigned P = 0; P != NumPhases; ++P)
+    OS << "    \"" << PhaseNames[P] << "\": {\"seconds\": "
+       << format("%.9f", Phases[P].Seconds) << ", \"count\": "
+       << Phases[P].Count << "}" << (P + 1 != NumPhases ? ",\n" : "\n");
+  OS << "  },\n"
+     << "  \"tokens\": " << NumTokens << ",\n"
+     << "  \"ast_nodes\": " << NumASTNodes << ",\n"
+     << "  \"ir_instructions_before_opt\": " << NumInstsBeforeOpt << ",\n"
+     << "  \"ir_instructions_after_opt\": " << NumInstsAfterOpt << ",\n"
+     << "  \"modules\": " << NumModules << ",\n"
+     << "  \"peak_rss_kb\": " << getPeakRSS() << ",\n"
+     << "  \"expression_seconds\": [";
+  for (unsigned I = 0, E = ExprSeconds.size(); I != E; ++I)
+    OS << (I ? ", " : "") << format("%.9f", ExprSeconds[I]);
+  OS << "]\n}\n";
+}
+
 //===----------------------------------------------------------------------===//
 // Main driver code.
 //===----------------------------------------------------------------------===//
 
-int main() {
-  InitializeNativeTarget();
-  InitializeNativeTargetAsmPrinter();
-  InitializeNativeTargetAsmParser();
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
+
+  CodeGenOpt::Level CGOptLevel = CodeGenOpt::Default;
+  switch (OptLevel) {
+  case ' ':
+    break;
+  case '0':
+    CGOptLevel = CodeGenOpt::None;
+    break;
+  case '1':
+    CGOptLevel = CodeGenOpt::Less;
+    break;
+  case '2':
+    CGOptLevel = CodeGenOpt::Default;
+    break;
+  case '3':
+    CGOptLevel = CodeGenOpt::Aggressive;
+    break;
+  default:
+    errs() << argv[0] << ": invalid optimization level -O" << OptLevel << "\n";
+    return 1;
+  }
 
   // Install standard binary operators.
   // 1 is lowest precedence.
@@ -1247,16 +5481,141 @@ int main() {
   BinopPrecedence['-'] = 20;
   BinopPrecedence['*'] = 40; // highest.
 
+  if (Bench == BenchLex) {
+    RunLexBench();
+    return 0;
+  }
+  if (Bench == BenchParse) {
+    RunParseBench();
+    return 0;
+  }
+
+  if (Bench == BenchRepl && InputFilename == "-")
+    Source.setBuffer(generateReplBenchProgram(BenchLines));
+  else if (Bench == BenchArrays)
+    Source.setBuffer(generateArrayBenchProgram(BenchElements));
+  else if (Bench == BenchTailCalls)
+    Source.setBuffer(generateTailCallBenchProgram(BenchDepth));
+  else if (Bench == BenchOperators)
+    Source.setBuffer(generateOperatorBenchProgram(BenchTrips));
+  else if (Bench == BenchParfor)
+    Source.setBuffer(generateParforBenchProgram());
+  else if (Bench == BenchFastMath)
+    Source.setBuffer(generateFastMathBenchProgram(BenchElements));
+  else if (!Source.open(InputFilename))
+    return 1;
+
+  if (!ProfileUse.empty() && !loadProfile(ProfileUse))
+    return 1;
+
+  // An object file gets the whole input in one module, and nothing runs.
+  if (!EmitObj.empty()) {
+    if (Lazy || Tiered || !ProfileGenerate.empty() || Bench != BenchNone) {
+      errs() << argv[0] << ": -emit-obj can't be combined with -lazy, "
+                           "-tiered, -profile-generate or -bench\n";
+      return 1;
+    }
+    Batch = true;
+    BatchChunkSize = 0;
+  }
+
+  // Only a single module holds the whole program.
+  if (WholeProgram && (!Batch || BatchChunkSize)) {
+    errs() << argv[0] << ": -whole-program needs -batch with a single "
+                         "module\n";
+    return 1;
+  }
+
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+
   // Prime the first token.
-  fprintf(stderr, "ready> ");
+  if (!Batch && Bench == BenchNone)
+    fprintf(stderr, "ready> ");
   getNextToken();
 
-  TheJIT = llvm::make_unique<KaleidoscopeJIT>();
+  // Contraction happens in the backend, which -fast-math also asks for on
+  // each function.
+  TargetOptions Options;
+  if (FPContract)
+    Options.AllowFPOpFusion = FPOpFusion::Fast;
+  TheJIT = llvm::make_unique<KaleidoscopeJIT>(CGOptLevel, Options);
+  TheJIT->setCompileThreads(CompileThreads);
+  if (!CacheDir.empty()) {
+    // The key covers what the IR does not say about the code: the target,
+    // down to its features, and the code generator's options.  Fast math is
+    // in the IR, as each function's attributes; FP contraction is not.
+    TargetMachine &TM = TheJIT->getTargetMachine();
+    TheObjectCache = llvm::make_unique<DiskObjectCache>(
+        CacheDir, TM.getTargetTriple().str() + "-" +
+                      TM.getTargetCPU().str() + "-" +
+                      TM.getTargetFeatureString().str() + "-O" +
+                      std::to_string((int)TM.getOptLevel()) + "-fp-contract" +
+                      std::to_string((int)TM.Options.AllowFPOpFusion));
+    TheJIT->setObjectCache(TheObjectCache.get());
+  }
 
   InitializeModuleAndPassManager();
+  InitializeExprSlot();
 
   // Run the main "interpreter loop" now.
-  MainLoop();
+  if (Bench == BenchRepl)
+    RunReplBench();
+  else if (Bench == BenchArrays)
+    RunArrayBench();
+  else if (Bench == BenchTailCalls)
+    RunTailCallBench();
+  else if (Bench == BenchOperators)
+    RunOperatorBench();
+  else if (Bench == BenchParfor)
+    RunParforBench();
+  else if (Bench == BenchFastMath)
+    RunFastMathBench();
+  else
+    MainLoop();
 
+  if (!EmitObj.empty()) {
+    if (!EmitObjectFile())
+      return 1;
+  } else if (Batch) {
+    RunBatchExprs();
+  }
+  if (!ProfileGenerate.empty())
+    writeProfile(ProfileGenerate);
+  if (Batch || ReportCompileTime) {
+    fprintf(stderr, "compile: %u definitions in %u modules, %.1f ms\n",
+            NumDefinitions, NumModules, CompileSeconds * 1000);
+    if (Lazy)
+      fprintf(stderr, "lazy: %u definitions never compiled\n",
+              (unsigned)LazyDefinitions.size());
+    if (Tiered)
+      fprintf(stderr,
+              "tiers: %u expressions interpreted, %u JIT'd, %u functions "
+              "promoted\n",
+              NumInterpretedExprs, NumCompiledExprs, NumPromotions);
+    if (TheObjectCache)
+      fprintf(stderr, "cache: %u hits, %u misses\n", TheObjectCache->Hits,
+              TheObjectCache->Misses);
+    if (NumSimplifiedNodes)
+      fprintf(stderr, "simplify: %llu AST nodes removed\n",
+              (unsigned long long)NumSimplifiedNodes);
+  }
+  if (ReportMemo)
+    PrintMemoReport();
+  if (TimeReport)
+    PrintTimeReport();
+  if (!TimeReportJSON.empty())
+    WriteTimeReportJSON(TimeReportJSON);
+
+  // Tear the JIT down before llvm_shutdown(), which prints the reports asked
+  // for with -time-passes or -stats.
+  TheFPM.reset();
+  TheModule.reset();
+  Builder.reset();
+  TheContext.reset();
+  DestroyExprSlot();
+  TheJIT.reset();
+  llvm_shutdown();
   return 0;
 }